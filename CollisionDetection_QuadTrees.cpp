@@ -7,24 +7,680 @@
 #include "../Extensions/DGE_AffineTransforms.hpp"
 
 #include <array>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <queue>
+#include <functional>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define QUADTREES_AVX
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define QUADTREES_SSE
+#endif
+
+// The compact areas are tested 8 at a time with SSE2
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QUADTREES_SSE2
+#endif
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef QUADTREES_COUNT_ALLOCATIONS
+#include <new>
+
+// Counts every heap allocation of the program so the cost of a query can be measured
+std::atomic<size_t> g_Allocations = 0;
+
+void* operator new(size_t size)
+{
+    g_Allocations++;
+
+    if (void* p = std::malloc(size))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+
+// Work done by the area queries of every tree, compiled out unless QUADTREES_QUERY_STATS
+// is defined. Take query_stats() before and after a query to measure it
+struct QueryStats
+{
+    size_t nodesVisited = 0;
+    size_t itemsTested = 0;
+    size_t itemsReturned = 0;
+};
+
+#ifdef QUADTREES_QUERY_STATS
+std::atomic<size_t> g_NodesVisited = 0;
+std::atomic<size_t> g_ItemsTested = 0;
+std::atomic<size_t> g_ItemsReturned = 0;
+#endif
+
+QueryStats query_stats()
+{
+#ifdef QUADTREES_QUERY_STATS
+    return { g_NodesVisited, g_ItemsTested, g_ItemsReturned };
+#else
+    return {};
+#endif
+}
+
+QueryStats operator-(const QueryStats& a, const QueryStats& b)
+{
+    return { a.nodesVisited - b.nodesVisited, a.itemsTested - b.itemsTested, a.itemsReturned - b.itemsReturned };
+}
+
+// Called once per visited node so the atomics aren't touched for every item
+void count_query(size_t nodes, size_t tested, size_t returned)
+{
+#ifdef QUADTREES_QUERY_STATS
+    g_NodesVisited += nodes;
+    g_ItemsTested += tested;
+    g_ItemsReturned += returned;
+#else
+    (void)nodes; (void)tested; (void)returned;
+#endif
+}
 
 bool overlaps(const def::rectf& r1, const def::rectf& r2)
 {
     return r1.pos < r2.pos + r2.size && r1.pos + r1.size >= r2.pos;
 }
 
-template <class T>
+// Unlike overlaps() the result doesn't depend on the order of the rectangles
+bool mutually_overlap(const def::rectf& r1, const def::rectf& r2)
+{
+    return overlaps(r1, r2) && overlaps(r2, r1);
+}
+
+// Squared distance from the point to the closest point of the rectangle, 0 if it's inside
+float distance2(const def::vf2d& point, const def::rectf& r)
+{
+    float dx = std::max({ r.pos.x - point.x, 0.0f, point.x - (r.pos.x + r.size.x) });
+    float dy = std::max({ r.pos.y - point.y, 0.0f, point.y - (r.pos.y + r.size.y) });
+
+    return dx * dx + dy * dy;
+}
+
+// Ray with a normalized direction and its inverse so the slab tests don't divide
+struct Ray
+{
+    Ray(const def::vf2d& origin, const def::vf2d& direction)
+        : origin(origin), direction(direction / std::sqrt(direction.x * direction.x + direction.y * direction.y))
+    {
+        inverse = { 1.0f / this->direction.x, 1.0f / this->direction.y };
+    }
+
+    // Bounding box of the segment from the origin to the distance, which can be infinite.
+    // The corners are nudged outwards so the areas that only touch the segment
+    // still overlap the box like they pass ray_enters()
+    void bounds(float distance, def::vf2d& low, def::vf2d& high) const
+    {
+        auto reach = [&](float start, float step)
+            {
+                return step == 0.0f ? start : start + step * distance;
+            };
+
+        def::vf2d end(reach(origin.x, direction.x), reach(origin.y, direction.y));
+
+        const float down = -std::numeric_limits<float>::infinity();
+        const float up = std::numeric_limits<float>::infinity();
+
+        low.x = std::nextafter(std::min(origin.x, end.x), down);
+        low.y = std::nextafter(std::min(origin.y, end.y), down);
+        high.x = std::nextafter(std::max(origin.x, end.x), up);
+        high.y = std::nextafter(std::max(origin.y, end.y), up);
+    }
+
+    def::vf2d origin;
+    def::vf2d direction;
+    def::vf2d inverse;
+};
+
+// Distance along the ray to the point where it enters the rectangle, 0 if it starts inside.
+// Returns false if the ray misses the rectangle or enters it farther than maxDistance
+bool ray_enters(const Ray& ray, const def::rectf& r, float maxDistance, float& distance)
+{
+    float enter = 0.0f;
+    float leave = maxDistance;
+
+    auto clip = [&](float start, float step, float inverse, float low, float high)
+        {
+            // Parallel to the slab so it's either always inside or never
+            if (step == 0.0f)
+                return start >= low && start <= high;
+
+            float t1 = (low - start) * inverse;
+            float t2 = (high - start) * inverse;
+
+            if (t1 > t2)
+                std::swap(t1, t2);
+
+            enter = std::max(enter, t1);
+            leave = std::min(leave, t2);
+
+            return enter <= leave;
+        };
+
+    if (!clip(ray.origin.x, ray.direction.x, ray.inverse.x, r.pos.x, r.pos.x + r.size.x) ||
+        !clip(ray.origin.y, ray.direction.y, ray.inverse.y, r.pos.y, r.pos.y + r.size.y))
+        return false;
+
+    distance = enter;
+    return true;
+}
+
+// Calls func with the index of every area that overlaps the box from low to high, the areas
+// are stored as separate arrays. Does the same test as overlaps() for 8 areas at a time with AVX
+// or 4 with SSE. The edges of the box can be infinite
+template <class Func>
+void for_each_overlapping(const float* x, const float* y, const float* w, const float* h,
+    size_t count, const def::vf2d& low, const def::vf2d& high, Func&& func)
+{
+    const float left = low.x;
+    const float top = low.y;
+    const float right = high.x;
+    const float bottom = high.y;
+
+    size_t i = 0;
+
+#if defined(QUADTREES_AVX)
+    const __m256 left8 = _mm256_set1_ps(left);
+    const __m256 top8 = _mm256_set1_ps(top);
+    const __m256 right8 = _mm256_set1_ps(right);
+    const __m256 bottom8 = _mm256_set1_ps(bottom);
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x8 = _mm256_loadu_ps(x + i);
+        __m256 y8 = _mm256_loadu_ps(y + i);
+
+        __m256 hit = _mm256_and_ps(
+            _mm256_and_ps(
+                _mm256_cmp_ps(left8, _mm256_add_ps(x8, _mm256_loadu_ps(w + i)), _CMP_LT_OQ),
+                _mm256_cmp_ps(top8, _mm256_add_ps(y8, _mm256_loadu_ps(h + i)), _CMP_LT_OQ)),
+            _mm256_and_ps(
+                _mm256_cmp_ps(right8, x8, _CMP_GE_OQ),
+                _mm256_cmp_ps(bottom8, y8, _CMP_GE_OQ)));
+
+        for (int mask = _mm256_movemask_ps(hit), j = 0; mask != 0; mask >>= 1, j++)
+        {
+            if (mask & 1)
+                func(i + j);
+        }
+    }
+#elif defined(QUADTREES_SSE)
+    const __m128 left4 = _mm_set1_ps(left);
+    const __m128 top4 = _mm_set1_ps(top);
+    const __m128 right4 = _mm_set1_ps(right);
+    const __m128 bottom4 = _mm_set1_ps(bottom);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x4 = _mm_loadu_ps(x + i);
+        __m128 y4 = _mm_loadu_ps(y + i);
+
+        __m128 hit = _mm_and_ps(
+            _mm_and_ps(
+                _mm_cmplt_ps(left4, _mm_add_ps(x4, _mm_loadu_ps(w + i))),
+                _mm_cmplt_ps(top4, _mm_add_ps(y4, _mm_loadu_ps(h + i)))),
+            _mm_and_ps(
+                _mm_cmpge_ps(right4, x4),
+                _mm_cmpge_ps(bottom4, y4)));
+
+        for (int mask = _mm_movemask_ps(hit), j = 0; mask != 0; mask >>= 1, j++)
+        {
+            if (mask & 1)
+                func(i + j);
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        if (left < x[i] + w[i] && top < y[i] + h[i] && right >= x[i] && bottom >= y[i])
+            func(i);
+    }
+}
+
+// The same for the areas in 16-bit steps, the box from left to right and top to bottom is in the steps too
+template <class Func>
+void for_each_overlapping(const uint16_t* x, const uint16_t* y, const uint16_t* w, const uint16_t* h,
+    size_t count, uint16_t left, uint16_t top, uint16_t right, uint16_t bottom, Func&& func)
+{
+    size_t i = 0;
+
+#if defined(QUADTREES_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i left8 = _mm_set1_epi16(int16_t(left));
+    const __m128i top8 = _mm_set1_epi16(int16_t(top));
+    const __m128i right8 = _mm_set1_epi16(int16_t(right));
+    const __m128i bottom8 = _mm_set1_epi16(int16_t(bottom));
+
+    // There are no unsigned 16-bit comparisons in SSE2, a >= b when b - a saturates to 0
+    auto greater_equal = [&](__m128i a, __m128i b) { return _mm_cmpeq_epi16(_mm_subs_epu16(b, a), zero); };
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i x8 = _mm_loadu_si128((const __m128i*)(x + i));
+        __m128i y8 = _mm_loadu_si128((const __m128i*)(y + i));
+
+        // x + w and y + h never go over 65535
+        __m128i itemRight8 = _mm_add_epi16(x8, _mm_loadu_si128((const __m128i*)(w + i)));
+        __m128i itemBottom8 = _mm_add_epi16(y8, _mm_loadu_si128((const __m128i*)(h + i)));
+
+        __m128i hit = _mm_andnot_si128(
+            _mm_or_si128(greater_equal(left8, itemRight8), greater_equal(top8, itemBottom8)),
+            _mm_and_si128(greater_equal(right8, x8), greater_equal(bottom8, y8)));
+
+        // Two bits for each area
+        for (int mask = _mm_movemask_epi8(hit), j = 0; mask != 0; mask >>= 2, j++)
+        {
+            if (mask & 1)
+                func(i + j);
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        if (left < x[i] + w[i] && top < y[i] + h[i] && right >= x[i] && bottom >= y[i])
+            func(i);
+    }
+}
+
+// Calls func for the items that overlap the area
+template <class T, class Func>
+void find_overlapping(const float* x, const float* y, const float* w, const float* h,
+    const T* data, size_t count, const def::rectf& area, Func& func)
+{
+    for_each_overlapping(x, y, w, h, count, area.pos, area.pos + area.size, [&](size_t i) { func(data[i]); });
+}
+
+// Layout of the files written by QuadTree::save() and mapped by MappedQuadTree.
+// The offsets are from the start of the file and every array is aligned to 64 bytes
+struct QuadTreeSnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+
+    // sizeof of the stored items, a file can only be mapped with the same item type
+    uint32_t itemSize;
+
+    uint32_t nodesCount;
+    uint32_t itemsCount;
+
+    uint64_t nodesOffset;
+    uint64_t xOffset, yOffset, wOffset, hOffset;
+    uint64_t dataOffset;
+    uint64_t fileSize;
+};
+
+// The nodes are stored depth-first so the items of every subtree are contiguous
+struct QuadTreeSnapshotNode
+{
+    // { x, y, w, h } of each child, enlarged in the loose mode
+    float childrenAreas[4][4];
+    uint32_t children[4];
+
+    // Items of the node itself, the rest of the subtree follows them
+    uint32_t firstItem;
+    uint32_t itemsCount;
+
+    // Number of items in the whole subtree
+    uint32_t count;
+};
+
+constexpr char QUADTREE_SNAPSHOT_MAGIC[8] = { 'D', 'G', 'E', 'Q', 'T', 'R', 'E', 'E' };
+constexpr uint32_t QUADTREE_SNAPSHOT_VERSION = 1;
+constexpr uint64_t QUADTREE_SNAPSHOT_ALIGNMENT = 64;
+
+// When the leaves of a QuadTree are split, the defaults split every node that an item fits below
+struct QuadTreeSubdivision
+{
+    // A leaf holds up to that many items before the ones that fit in its children are pushed down
+    size_t splitThreshold = 0;
+
+    // Levels below the root, the nodes at that depth are never split.
+    // build() doesn't go below QuadTree::MAX_BUILD_DEPTH anyway
+    size_t maxDepth = 32;
+
+    // The nodes which children would be smaller than that aren't split
+    float minNodeSize = 0.0f;
+};
+
+// If Loose is set then the children of each quad are enlarged by the looseness factor
+// and an item goes to the child that contains its centre, so items that cross
+// the borders of the quads still sink down instead of piling up near the root.
+// If Compact is set then the areas of the items are kept as 16-bit steps of the area of their node,
+// rounded outwards, so the queries can return items up to a couple of steps outside the query.
+// Only the bounds shrink, from 16 to 8 bytes per item. The data, the category and the nodes keep
+// their size, so the whole tree is only about an eighth smaller, see the "compact" benchmark
+template <class T, bool Loose = false, bool Compact = false>
 class QuadTree
 {
 public:
-    using Storage = std::list<std::pair<T, def::rectf>>;
+    using Index = uint32_t;
+    static constexpr Index NONE = std::numeric_limits<Index>::max();
+
+    using Storage = std::vector<std::pair<T, def::rectf>>;
 
     struct ItemLocation
     {
-        typename Storage::iterator iterator;
-        Storage* container = nullptr;
+        Index node = NONE;
+        Index slot = NONE;
+    };
+
+    // Steps of the area of a node in the compact mode
+    static constexpr float COMPACT_STEPS = 65535.0f;
+
+    using Coordinate = std::conditional_t<Compact, uint16_t, float>;
+
+    // Items of a quad, the areas are stored as separate arrays
+    // so they can be tested against a query 4 or 8 at a time
+    struct Items
+    {
+        std::vector<T> data;
+        std::vector<Coordinate> x, y, w, h;
+        std::vector<uint8_t> category;
+
+        // Compact coordinates are steps from the origin, unused otherwise
+        def::vf2d origin;
+        def::vf2d step;
+        def::vf2d stepsPerUnit;
+
+        size_t size() const
+        {
+            return data.size();
+        }
+
+        void reserve(size_t count)
+        {
+            data.reserve(count);
+            x.reserve(count);
+            y.reserve(count);
+            w.reserve(count);
+            h.reserve(count);
+            category.reserve(count);
+        }
+
+        void push_back(T item, const def::rectf& area, uint8_t itemCategory = 0)
+        {
+            data.push_back(std::move(item));
+            x.emplace_back();
+            y.emplace_back();
+            w.emplace_back();
+            h.emplace_back();
+            category.push_back(itemCategory);
+
+            set_area(size() - 1, area);
+        }
+
+        // Overwrites the item at the slot with the last one and removes the last one
+        void move_back_to(size_t slot)
+        {
+            data[slot] = std::move(data.back());
+            x[slot] = x.back();
+            y[slot] = y.back();
+            w[slot] = w.back();
+            h[slot] = h.back();
+            category[slot] = category.back();
+
+            pop_back();
+        }
+
+        // Removes the items from count onwards
+        void truncate(size_t count)
+        {
+            data.erase(data.begin() + count, data.end());
+            x.resize(count);
+            y.resize(count);
+            w.resize(count);
+            h.resize(count);
+            category.resize(count);
+        }
+
+        void pop_back()
+        {
+            data.pop_back();
+            x.pop_back();
+            y.pop_back();
+            w.pop_back();
+            h.pop_back();
+            category.pop_back();
+        }
+
+        // In the compact mode the area contains the one that was stored
+        def::rectf area(size_t slot) const
+        {
+            if constexpr (Compact)
+            {
+                return def::rectf(
+                    { origin.x + x[slot] * step.x, origin.y + y[slot] * step.y },
+                    { w[slot] * step.x, h[slot] * step.y });
+            }
+            else
+                return def::rectf({ x[slot], y[slot] }, { w[slot], h[slot] });
+        }
+
+        void set_area(size_t slot, const def::rectf& area)
+        {
+            if constexpr (Compact)
+            {
+                def::vf2d end = origin + step * COMPACT_STEPS;
+
+                if (area.pos.x < origin.x || area.pos.y < origin.y ||
+                    area.pos.x + area.size.x > end.x || area.pos.y + area.size.y > end.y)
+                {
+                    // Only an item outside the area of the root gets here
+                    def::vf2d low(std::min(area.pos.x, origin.x), std::min(area.pos.y, origin.y));
+                    def::vf2d high(std::max(area.pos.x + area.size.x, end.x), std::max(area.pos.y + area.size.y, end.y));
+
+                    set_frame(def::rectf(low - (high - low) * 0.5f, (high - low) * 2.0f));
+                }
+
+                // One more step on every side covers the rounding of the floats
+                x[slot] = Coordinate(std::max(std::floor((area.pos.x - origin.x) * stepsPerUnit.x) - 1.0f, 0.0f));
+                y[slot] = Coordinate(std::max(std::floor((area.pos.y - origin.y) * stepsPerUnit.y) - 1.0f, 0.0f));
+
+                w[slot] = Coordinate(std::min(std::ceil((area.pos.x + area.size.x - origin.x) * stepsPerUnit.x) + 1.0f, COMPACT_STEPS) - x[slot]);
+                h[slot] = Coordinate(std::min(std::ceil((area.pos.y + area.size.y - origin.y) * stepsPerUnit.y) + 1.0f, COMPACT_STEPS) - y[slot]);
+            }
+            else
+            {
+                x[slot] = area.pos.x;
+                y[slot] = area.pos.y;
+                w[slot] = area.size.x;
+                h[slot] = area.size.y;
+            }
+        }
+
+        // Area that the compact coordinates are relative to, the stored areas are rounded again.
+        // The frame is a bit larger than the area so the items at its edges are never clamped
+        void set_frame(const def::rectf& frame)
+        {
+            if constexpr (Compact)
+            {
+                std::vector<def::rectf> areas(size());
+
+                for (size_t slot = 0; slot < areas.size(); slot++)
+                    areas[slot] = area(slot);
+
+                def::vf2d extent(std::max(frame.size.x, 0.001f), std::max(frame.size.y, 0.001f));
+                def::vf2d margin = extent * (4.0f / COMPACT_STEPS);
+
+                origin = frame.pos - margin;
+                step = (extent + margin * 2.0f) / COMPACT_STEPS;
+                stepsPerUnit = { 1.0f / step.x, 1.0f / step.y };
+
+                for (size_t slot = 0; slot < areas.size(); slot++)
+                    set_area(slot, areas[slot]);
+            }
+            else
+                (void)frame;
+        }
+
+        // Calls func with the slot of every item that overlaps the box from low to high,
+        // the edges of the box can be infinite. The compact areas are tested in steps
+        template <class Func>
+        void for_each_overlapping(const def::vf2d& low, const def::vf2d& high, Func&& func) const
+        {
+            if constexpr (Compact)
+            {
+                // The stored areas always end after the first step and start before the last one
+                // so clamping the box to the steps of the node doesn't change which ones overlap it
+                auto to_steps = [](float value) { return uint16_t(std::clamp(value, 0.0f, COMPACT_STEPS)); };
+
+                ::for_each_overlapping(x.data(), y.data(), w.data(), h.data(), size(),
+                    to_steps(std::floor((low.x - origin.x) * stepsPerUnit.x)), to_steps(std::floor((low.y - origin.y) * stepsPerUnit.y)),
+                    to_steps(std::ceil((high.x - origin.x) * stepsPerUnit.x)), to_steps(std::ceil((high.y - origin.y) * stepsPerUnit.y)), func);
+            }
+            else
+                ::for_each_overlapping(x.data(), y.data(), w.data(), h.data(), size(), low, high, func);
+        }
+
+        void shrink_to_fit()
+        {
+            data.shrink_to_fit();
+            x.shrink_to_fit();
+            y.shrink_to_fit();
+            w.shrink_to_fit();
+            h.shrink_to_fit();
+            category.shrink_to_fit();
+        }
+
+        size_t memory_usage() const
+        {
+            return data.capacity() * sizeof(T) + category.capacity() +
+                (x.capacity() + y.capacity() + w.capacity() + h.capacity()) * sizeof(Coordinate);
+        }
+    };
+
+    struct Node
+    {
+        def::rectf area;
+
+        // Cached areas of each child, enlarged by the looseness factor in the loose mode
+        std::array<def::rectf, 4> childrenAreas;
+
+        // Indices of all 4 children in the node pool or NONE
+        std::array<Index, 4> children;
+
+        // NONE for the root
+        Index parent;
+
+        size_t level;
+
+        // Number of items in the whole subtree
+        Index count;
+
+        // category_bit() of every item in the subtree. Removals clear the bits only when
+        // the categories are counted, otherwise they can stay set until the subtree is empty
+        uint64_t categoryMask;
+
+        // Set once the node is split, from then on the items that fit in a child go down.
+        // Until then it's a leaf that keeps them all
+        bool divided;
+
+        // Items in the current quad
+        Items items;
+    };
+
+    // Called when an item is moved to another slot so its owner can update the stored location
+    struct IgnoreMoved
+    {
+        void operator()(T&, const ItemLocation&) const {}
+    };
+
+    // Trusts the stored areas in erase_in(), they are exact unless the tree is compact
+    struct StoredAreas
+    {
+        bool operator()(const T&) const { return true; }
     };
 
+    // Puts every item of a batch into the first category
+    struct NoCategory
+    {
+        template <class U>
+        uint8_t operator()(const U&) const { return 0; }
+    };
+
+    // Shape of the tree, see stats()
+    struct Stats
+    {
+        size_t nodes = 0;
+        size_t leaves = 0;
+        size_t items = 0;
+
+        // Levels below the root, the average is taken over the leaves
+        size_t maxDepth = 0;
+        float averageDepth = 0.0f;
+
+        // Items kept by the nodes that have children. In the tight tree these are the ones
+        // that straddle the borders of the children and every query that reaches the node tests them
+        size_t interiorItems = 0;
+
+        // itemsHistogram[0] is the number of empty nodes and itemsHistogram[i]
+        // the number of nodes with 2^(i - 1) to 2^i - 1 items
+        std::vector<size_t> itemsHistogram;
+
+        size_t bytes = 0;
+    };
+
+    // Deepest level that build() can reach, 2 bits of the path per level
+    static constexpr uint32_t MAX_BUILD_DEPTH = 32;
+
+    // Queries that can return fewer items than this stay on the calling thread
+    static constexpr size_t PARALLEL_QUERY_THRESHOLD = 50000;
+
+    // Depth of the subtrees that are handed to the threads by find_parallel()
+    static constexpr size_t PARALLEL_QUERY_DEPTH = 3;
+
+    // Filter of find() that lets every category through
+    static constexpr uint64_t ALL_CATEGORIES = ~uint64_t(0);
+
+    // Bit of the category in the filters of find(), the categories from 63 on share the last bit
+    static constexpr uint64_t category_bit(uint8_t category)
+    {
+        return uint64_t(1) << (category < 63 ? category : 63);
+    }
+
 public:
     QuadTree(const def::rectf& area = { {0.0f, 0.0f}, {128.0f, 128.0f} }, size_t level = 0)
     {
@@ -39,347 +695,4707 @@ public:
 
     void resize(const def::rectf& area)
     {
+        m_Area = area;
         clear();
+    }
 
-        m_Area = area;
-        def::vf2d childSize = area.size * 0.5f;
+    // The size of a loose child relative to its normal size, clears the tree
+    void set_looseness(float looseness)
+    {
+        m_Looseness = looseness;
+        clear();
+    }
 
-        m_ChildrenAreas =
-        {
-            def::rectf(area.pos, childSize),
-            def::rectf({ area.pos.x + childSize.x, area.pos.y }, childSize),
-            def::rectf({ area.pos.x, area.pos.y + childSize.y }, childSize),
-            def::rectf(area.pos + childSize, childSize)
-        };
+    float looseness() const
+    {
+        return m_Looseness;
     }
 
-    void clear()
+    // Number of categories which items are counted separately in every subtree, clears the tree.
+    // The category of an item is given when it's inserted, the items of the categories
+    // from the count on aren't counted and only show in the category masks
+    void set_categories(size_t count)
     {
-        m_Items.clear();
+        m_Categories = count;
+        clear();
+    }
 
-        for (auto& child : m_Children)
-        {
-            if (child) child->clear();
-            child.reset();
-        }
+    size_t categories() const
+    {
+        return m_Categories;
     }
 
-    size_t size() const
+    // Fewer but fuller nodes make the queries go through fewer levels, clears the tree
+    void set_subdivision(const QuadTreeSubdivision& subdivision)
+    {
+        m_Subdivision = subdivision;
+        clear();
+    }
+
+    const QuadTreeSubdivision& subdivision() const
+    {
+        return m_Subdivision;
+    }
+
+    void clear()
     {
-        size_t count = m_Items.size();
+        // The root is always at index 0
+        m_Nodes.clear();
+        m_FreeNodes.clear();
+        m_Trimmed = 0;
+        m_Compacted = true;
+        m_CategoryCounts.clear();
+        allocate(m_Area, m_Level, NONE);
+    }
+
+    // The root counts the items of the whole tree
+    size_t size() const
+    {
+        return m_Nodes[0].count;
+    }
+
+    // The items that are pushed down when a leaf gets split are passed to moved
+    template <class Moved = IgnoreMoved>
+    ItemLocation insert(const T& item, const def::rectf& area, uint8_t category = 0, Moved&& moved = Moved())
+    {
+        Index node = descend(0, area);
+
+        while (should_divide(node, 1))
+        {
+            divide(node, moved);
+            node = descend(node, area);
+        }
+
+        add_count(node, NONE, 1, category);
+
+        Items& items = m_Nodes[node].items;
+        items.push_back(item, area, category);
+
+        return { node, Index(items.size() - 1) };
+    }
+
+    // Moves an item to a new area starting from the node where it's stored now,
+    // so it only goes up to the first node that contains the area and then down
+    // as far as it fits. Returns the new location of the item
+    template <class Moved = IgnoreMoved>
+    ItemLocation relocate(const ItemLocation& location, const def::rectf& area, Moved&& moved = Moved())
+    {
+        Index ancestor = location.node;
+
+        while (ancestor != 0 && !def::contains(bounds(m_Nodes[ancestor].area), area))
+            ancestor = m_Nodes[ancestor].parent;
+
+        Index node = descend(ancestor, area);
+
+        if (node == location.node)
+        {
+            m_Nodes[node].items.set_area(location.slot, area);
+            return location;
+        }
+
+        // The leaf has no children so the item isn't one of those that get pushed down
+        while (should_divide(node, 1))
+        {
+            divide(node, moved);
+            node = descend(node, area);
+        }
+
+        uint8_t category = m_Nodes[location.node].items.category[location.slot];
+
+        // Counts above the common ancestor stay the same
+        add_count(location.node, ancestor, -1, category);
+        add_count(node, ancestor, 1, category);
+
+        T item = std::move(m_Nodes[location.node].items.data[location.slot]);
+        erase_slot(location, moved);
+
+        // The new node still counts the item so it's never among the pruned ones
+        prune(location.node);
+
+        Items& items = m_Nodes[node].items;
+        items.push_back(std::move(item), area, category);
+
+        return { node, Index(items.size() - 1) };
+    }
+
+    // Builds the tree from a batch of items in a single pass. The items are sorted once
+    // by their path from the root (Z-order of the quads) so nodes are created in depth-first
+    // order and every subtree ends up contiguous in the pool. If parallel is set then
+    // each of the 4 top-level quadrants is sorted and built on its own thread.
+    // category(item) gives the category of each item when the categories are counted
+    template <class Placed = IgnoreMoved, class Categorize = NoCategory>
+    void build(const Storage& items, bool parallel = false, Placed&& placed = Placed(), Categorize&& category = Categorize())
+    {
+        clear();
+
+        // The root must be split for the quadrants to be built apart
+        parallel = parallel && items.size() > m_Subdivision.splitThreshold && can_divide(m_Level, m_Area);
+
+        std::vector<BuildKey> keys(items.size());
+
+        auto make_keys = [&](size_t first, size_t last)
+            {
+                for (size_t i = first; i < last; i++)
+                    keys[i] = make_key(items[i].second, Index(i));
+            };
+
+        if (parallel)
+        {
+            size_t threadsCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+            size_t chunk = (keys.size() + threadsCount - 1) / threadsCount;
+
+            std::vector<std::thread> threads;
+
+            for (size_t first = 0; first < keys.size(); first += chunk)
+                threads.emplace_back(make_keys, first, std::min(first + chunk, keys.size()));
+
+            for (auto& thread : threads)
+                thread.join();
+
+            // Group the keys: items that stay in the root and then each quadrant
+            std::array<size_t, 7> offsets{};
+
+            for (const auto& key : keys)
+                offsets[quadrant_of(key) + 2]++;
+
+            for (size_t i = 2; i < offsets.size(); i++)
+                offsets[i] += offsets[i - 1];
+
+            std::vector<BuildKey> grouped(keys.size());
+
+            for (const auto& key : keys)
+                grouped[offsets[quadrant_of(key) + 1]++] = key;
+
+            for (size_t i = offsets[0]; i < offsets[1]; i++)
+            {
+                const auto& item = items[grouped[i].index];
+                m_Nodes[0].items.push_back(item.first, item.second, category(item.first));
+            }
+
+            std::array<std::vector<Node>, 4> subtrees;
+            threads.clear();
+
+            for (size_t q = 0; q < 4; q++)
+            {
+                if (offsets[q + 1] == offsets[q + 2])
+                    continue;
+
+                threads.emplace_back([&, q]()
+                    {
+                        BuildKey* first = grouped.data() + offsets[q + 1];
+                        BuildKey* last = grouped.data() + offsets[q + 2];
+
+                        std::sort(first, last);
+                        limit_keys(first, last, 1, split(m_Area)[q]);
+
+                        allocate(subtrees[q], split(m_Area)[q], m_Level + 1, 0);
+                        build(subtrees[q], first, last, 1, items, category);
+                    });
+            }
+
+            for (auto& thread : threads)
+                thread.join();
+
+            m_Nodes[0].divided = true;
+
+            // Splice the subtrees into the pool
+            for (size_t q = 0; q < 4; q++)
+            {
+                if (subtrees[q].empty())
+                    continue;
+
+                Index offset = Index(m_Nodes.size());
+                m_Nodes[0].children[q] = offset;
+
+                for (auto& node : subtrees[q])
+                {
+                    for (auto& child : node.children)
+                    {
+                        if (child != NONE)
+                            child += offset;
+                    }
+
+                    // The parent of the local root is already the root of the tree
+                    if (&node != &subtrees[q][0])
+                        node.parent += offset;
+
+                    m_Nodes.push_back(std::move(node));
+                }
+            }
+        }
+        else
+        {
+            make_keys(0, keys.size());
+            std::sort(keys.begin(), keys.end());
+            limit_keys(keys.data(), keys.data() + keys.size(), 0, m_Area);
+
+            build(m_Nodes, keys.data(), keys.data() + keys.size(), 0, items, category);
+        }
+
+        for (Index n = 0; n < m_Nodes.size(); n++)
+        {
+            Items& nodeItems = m_Nodes[n].items;
+
+            for (Index slot = 0; slot < nodeItems.size(); slot++)
+                placed(nodeItems.data[slot], { n, slot });
+        }
+
+        m_CategoryCounts.assign(m_Nodes.size() * m_Categories, 0);
+
+        // Children are always allocated after their parents
+        for (Index n = Index(m_Nodes.size()); n-- > 0; )
+        {
+            Node& node = m_Nodes[n];
+            node.count += Index(node.items.size());
+
+            for (uint8_t c : node.items.category)
+                node.categoryMask |= category_bit(c);
+
+            for (uint8_t c : node.items.category)
+            {
+                if (c < m_Categories)
+                    m_CategoryCounts[n * m_Categories + c]++;
+            }
+
+            if (node.parent != NONE)
+            {
+                m_Nodes[node.parent].count += node.count;
+                m_Nodes[node.parent].categoryMask |= node.categoryMask;
+
+                for (size_t c = 0; c < m_Categories; c++)
+                    m_CategoryCounts[node.parent * m_Categories + c] += m_CategoryCounts[n * m_Categories + c];
+            }
+        }
+    }
+
+    void find(const def::rectf& area, std::list<T>& data) const
+    {
+        find(area, [&](const T& item) { data.push_back(item); });
+    }
+
+    void find(const def::rectf& area, std::vector<T>& data) const
+    {
+        find(area, [&](const T& item) { data.push_back(item); });
+    }
+
+    // Calls func for every item that overlaps the area without allocating anything
+    template <class Func>
+    void find(const def::rectf& area, Func&& func) const
+    {
+        find(0, area, func);
+    }
+
+    void find(const def::rectf& area, uint64_t categories, std::vector<T>& data) const
+    {
+        find(area, categories, [&](const T& item) { data.push_back(item); });
+    }
+
+    // Only the items which category_bit() is in categories, the subtrees without any of them are skipped
+    template <class Func>
+    void find(const def::rectf& area, uint64_t categories, Func&& func) const
+    {
+        if (m_Nodes[0].categoryMask & categories)
+            find(0, area, categories, func);
+    }
+
+    template <class Moved = IgnoreMoved>
+    bool remove(const T& item, Moved&& moved = Moved())
+    {
+        for (Index n = 0; n < m_Nodes.size(); n++)
+        {
+            const std::vector<T>& data = m_Nodes[n].items.data;
+
+            auto it = std::find(data.begin(), data.end(), item);
+
+            if (it != data.end())
+            {
+                erase({ n, Index(it - data.begin()) }, moved);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Removes an item by swapping it with the last item of the node,
+    // the nodes left without any item in their subtree are freed
+    template <class Moved = IgnoreMoved>
+    void erase(const ItemLocation& location, Moved&& moved = Moved())
+    {
+        add_count(location.node, NONE, -1, m_Nodes[location.node].items.category[location.slot]);
+        erase_slot(location, moved);
+        prune(location.node);
+    }
+
+    // Removes every item that overlaps the area in a single traversal and returns their number.
+    // erased(item) is called for each of them before it's destroyed. The subtrees covered
+    // by the area are emptied at once without moving any item and their nodes are reused by the next inserts.
+    // The other items whose stored area overlaps the area are only removed when exact(item) is true,
+    // the compact tree must get the real test there as its rounded areas can overlap when the items don't
+    template <class Erased, class Moved = IgnoreMoved, class Exact = StoredAreas>
+    size_t erase_in(const def::rectf& area, Erased&& erased, Moved&& moved = Moved(), Exact&& exact = Exact())
+    {
+        static_assert(!Compact || !std::is_same_v<std::decay_t<Exact>, StoredAreas>,
+            "The compact tree would remove the items next to the area, pass exact(item)");
+
+        std::vector<Index> slots;
+        return erase_in(0, area, slots, erased, moved, exact);
+    }
+
+    // Moves the nodes at the end of the pool into the holes left by the freed ones and then trims
+    // the memory of the items that were mostly removed, so the storage is dense again after mass
+    // removals. It stops when the budget runs out and carries on from there at the next call,
+    // returns true once it's done. The items of the moved nodes are passed to moved
+    template <class Moved = IgnoreMoved>
+    bool compact(std::chrono::microseconds budget = std::chrono::microseconds::max(), Moved&& moved = Moved())
+    {
+        if (m_Compacted)
+            return true;
+
+        auto start = std::chrono::steady_clock::now();
+
+        auto out_of_time = [&]()
+            {
+                return budget != std::chrono::microseconds::max() && std::chrono::steady_clock::now() - start >= budget;
+            };
+
+        // The lowest holes are filled first and the free nodes at the end are just cut off
+        if (!std::is_sorted(m_FreeNodes.begin(), m_FreeNodes.end()))
+            std::sort(m_FreeNodes.begin(), m_FreeNodes.end());
+
+        // Every call makes some progress however small the budget is
+        size_t hole = 0;
+        bool stopped = false;
+
+        while (hole < m_FreeNodes.size() && !stopped)
+        {
+            Index last = Index(m_Nodes.size() - 1);
+
+            if (m_FreeNodes.back() == last)
+            {
+                m_FreeNodes.pop_back();
+                m_Nodes.pop_back();
+                m_CategoryCounts.resize(m_Nodes.size() * m_Categories);
+            }
+            else
+                move_node(last, m_FreeNodes[hole++], moved);
+
+            stopped = out_of_time();
+        }
+
+        m_FreeNodes.erase(m_FreeNodes.begin(), m_FreeNodes.begin() + hole);
+
+        if (!m_FreeNodes.empty())
+            return false;
+
+        while (m_Trimmed < m_Nodes.size() && !stopped)
+        {
+            Items& items = m_Nodes[m_Trimmed++].items;
+
+            if (items.data.capacity() > 2 * items.size())
+                items.shrink_to_fit();
+
+            if (m_Trimmed % 256 == 0)
+                stopped = out_of_time();
+        }
+
+        if (m_Trimmed < m_Nodes.size())
+            return false;
+
+        if (m_Nodes.capacity() > 2 * m_Nodes.size())
+        {
+            m_Nodes.shrink_to_fit();
+            m_CategoryCounts.shrink_to_fit();
+            m_FreeNodes.shrink_to_fit();
+        }
+
+        m_Trimmed = 0;
+        m_Compacted = true;
+
+        return true;
+    }
+
+    // Splits the query between threads if it can return at least threshold items,
+    // the top subtrees are shared between the threads and each thread
+    // collects its items into its own buffer that is appended to data at the end
+    void find_parallel(const def::rectf& area, std::vector<T>& data, size_t threshold = PARALLEL_QUERY_THRESHOLD) const
+    {
+        // Pairs of a subtree and whether it is fully covered by the area
+        std::vector<std::pair<Index, bool>> tasks;
+        size_t expected = 0;
+
+        auto emit = [&](const T& item) { data.push_back(item); };
+
+        gather_tasks(0, 0, area, tasks, expected, emit);
+
+        size_t threadsCount = std::min<size_t>(std::thread::hardware_concurrency(), tasks.size());
+
+        auto run_task = [&](const std::pair<Index, bool>& task, auto& func)
+            {
+                if (task.second)
+                    collect_items(task.first, func);
+                else
+                    find(task.first, area, func);
+            };
+
+        if (expected < threshold || threadsCount < 2)
+        {
+            for (const auto& task : tasks)
+                run_task(task, emit);
+
+            return;
+        }
+
+        std::vector<std::vector<T>> buffers(threadsCount);
+        std::vector<std::thread> threads;
+        std::atomic<size_t> next = 0;
+
+        for (auto& buffer : buffers)
+        {
+            threads.emplace_back([&]()
+                {
+                    auto push = [&](const T& item) { buffer.push_back(item); };
+
+                    for (size_t i = next++; i < tasks.size(); i = next++)
+                        run_task(tasks[i], push);
+                });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        size_t total = data.size();
+
+        for (const auto& buffer : buffers)
+            total += buffer.size();
+
+        data.reserve(total);
+
+        for (const auto& buffer : buffers)
+            data.insert(data.end(), buffer.begin(), buffer.end());
+    }
+
+    void collect_items(std::list<T>& items) const
+    {
+        collect_items(0, [&](const T& item) { items.push_back(item); });
+    }
+
+    void collect_items(std::vector<T>& items) const
+    {
+        collect_items(0, [&](const T& item) { items.push_back(item); });
+    }
+
+    // Every node of the tree, see find_nodes() for drawing only a part of it
+    void collect_areas(std::list<def::rectf>& areas) const
+    {
+        for (Index n = 0; n < m_Nodes.size(); n++)
+        {
+            if (!is_free(n))
+                areas.push_back(m_Nodes[n].area);
+        }
+    }
+
+    // Calls func(area, depth, items, count) for the nodes that overlap the area without allocating
+    // anything, items is the number kept by the node itself and count the number in its subtree.
+    // The nodes maxDepth levels below the root or not bigger than minSize aren't entered,
+    // so a debug overlay costs as much as the nodes on the screen and not the whole tree
+    template <class Func>
+    void find_nodes(const def::rectf& area, size_t maxDepth, float minSize, Func&& func) const
+    {
+        if (overlaps(area, m_Nodes[0].area))
+            find_nodes(0, area, maxDepth, minSize, func);
+    }
+
+    // Calls func(a, b) once for every pair of items with overlapping areas. Each node
+    // tests its items against each other and against the items of its parents that reach
+    // into it, so no pair is reported twice. In the loose mode the children overlap so the
+    // pairs between two sibling subtrees are found by their parent. If parallel is set then
+    // the subtrees below the top levels are shared between threads and func must be safe to call from them
+    template <class Func>
+    void for_each_overlapping_pair(Func&& func, bool parallel = false) const
+    {
+        // One list of the parents' items per level so the traversal doesn't allocate
+        std::vector<Storage> buffers(depth() + 1);
+
+        if (!parallel)
+        {
+            find_pairs(0, 0, Storage(), buffers, func, nullptr);
+            return;
+        }
+
+        std::vector<PairsTask> tasks;
+        find_pairs(0, 0, Storage(), buffers, func, &tasks);
+
+        size_t threadsCount = std::min<size_t>(std::thread::hardware_concurrency(), tasks.size());
+
+        std::vector<std::thread> threads;
+        std::atomic<size_t> next = 0;
+
+        auto run_tasks = [&]()
+            {
+                std::vector<Storage> threadBuffers(buffers.size());
+
+                for (size_t i = next++; i < tasks.size(); i = next++)
+                {
+                    const PairsTask& task = tasks[i];
+
+                    if (task.other == NONE)
+                        find_pairs(task.node, task.depth, task.above, threadBuffers, func, nullptr);
+                    else
+                        find_cross_pairs(task.node, task.other, func);
+                }
+            };
+
+        for (size_t i = 1; i < threadsCount; i++)
+            threads.emplace_back(run_tasks);
+
+        run_tasks();
+
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    // Writes up to k items closest to the point and not farther than maxDistance
+    // to the result as { item, distance } pairs sorted by the distance. The nodes are visited
+    // in the order of their distance to the point and the search stops once the closest
+    // node left is farther than the k-th item found so far
+    void nearest(const def::vf2d& point, size_t k, float maxDistance, std::vector<std::pair<T, float>>& result) const
+    {
+        result.clear();
+
+        if (k == 0)
+            return;
+
+        using Entry = std::pair<float, Index>;
+
+        // Closest node at the top
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> nodes;
+
+        // Farthest of the best items at the top
+        auto farther = [](const std::pair<T, float>& a, const std::pair<T, float>& b) { return a.second < b.second; };
+        std::priority_queue<std::pair<T, float>, std::vector<std::pair<T, float>>, decltype(farther)> best(farther);
+
+        float limit = maxDistance * maxDistance;
+
+        // Items outside of the root's area are stored in the root so it's always visited
+        nodes.push({ 0.0f, 0 });
+
+        while (!nodes.empty() && nodes.top().first <= limit)
+        {
+            const Node& node = m_Nodes[nodes.top().second];
+            nodes.pop();
+
+            const Items& items = node.items;
+
+            for (size_t i = 0; i < items.size(); i++)
+            {
+                float d = distance2(point, items.area(i));
+
+                if (d > limit)
+                    continue;
+
+                best.push({ items.data[i], d });
+
+                if (best.size() > k)
+                    best.pop();
+
+                if (best.size() == k)
+                    limit = best.top().second;
+            }
+
+            for (size_t i = 0; i < 4; i++)
+            {
+                if (node.children[i] == NONE)
+                    continue;
+
+                float d = distance2(point, node.childrenAreas[i]);
+
+                if (d <= limit)
+                    nodes.push({ d, node.children[i] });
+            }
+        }
+
+        result.resize(best.size());
+
+        for (size_t i = result.size(); i-- > 0; best.pop())
+            result[i] = { best.top().first, std::sqrt(best.top().second) };
+    }
+
+    // Finds the closest item to the point, returns false if there are none within maxDistance
+    bool nearest(const def::vf2d& point, T& item, float maxDistance = std::numeric_limits<float>::max()) const
+    {
+        std::vector<std::pair<T, float>> result;
+        nearest(point, 1, maxDistance, result);
+
+        if (result.empty())
+            return false;
+
+        item = result.front().first;
+        return true;
+    }
+
+    // Level of detail query. The subtrees of the nodes not bigger than minSize are passed to
+    // tile(area, count, categories) as a whole instead of their items, where categories points
+    // to the count of each category in the subtree or is null if they aren't counted.
+    // The items of the bigger nodes that overlap the area are passed to func as usual. In the tight
+    // tree the items that cross the borders of the quads stay in the big nodes, the loose tree
+    // keeps every item at the level of its size so the output is bounded by the area
+    template <class Func, class Tile>
+    void find_lod(const def::rectf& area, float minSize, Func&& func, Tile&& tile) const
+    {
+        find_lod(0, area, minSize, func, tile);
+    }
+
+    // Finds the first item hit by the ray, the distance is where the ray enters its area.
+    // The children are visited front to back and the ones behind the closest hit so far are skipped.
+    // A segment is a ray with maxDistance set to its length
+    bool raycast(const def::vf2d& origin, const def::vf2d& direction, float maxDistance, T& item, float& distance) const
+    {
+        if (direction.x == 0.0f && direction.y == 0.0f)
+            return false;
+
+        distance = maxDistance;
+        bool hit = false;
+
+        raycast(0, Ray(origin, direction), distance, item, hit);
+        return hit;
+    }
+
+    // Writes every item hit by the ray within maxDistance to the result
+    // as { item, distance } pairs sorted by the distance
+    void raycast(const def::vf2d& origin, const def::vf2d& direction, float maxDistance, std::vector<std::pair<T, float>>& result) const
+    {
+        result.clear();
+
+        if (direction.x == 0.0f && direction.y == 0.0f)
+            return;
+
+        raycast(0, Ray(origin, direction), maxDistance, result);
+
+        std::sort(result.begin(), result.end(),
+            [](const std::pair<T, float>& a, const std::pair<T, float>& b) { return a.second < b.second; });
+    }
+
+    // Bytes allocated by the tree
+    size_t memory_usage() const
+    {
+        size_t bytes = sizeof(*this) + m_Nodes.capacity() * sizeof(Node) + m_CategoryCounts.capacity() * sizeof(Index);
+
+        for (const auto& node : m_Nodes)
+            bytes += node.items.memory_usage();
+
+        return bytes;
+    }
+
+    // Number of levels below the root
+    size_t depth() const
+    {
+        size_t deepest = m_Level;
+
+        for (Index n = 0; n < m_Nodes.size(); n++)
+        {
+            if (!is_free(n))
+                deepest = std::max(deepest, m_Nodes[n].level);
+        }
+
+        return deepest - m_Level;
+    }
+
+    Stats stats() const
+    {
+        Stats stats;
+        size_t leafLevels = 0;
+
+        for (Index n = 0; n < m_Nodes.size(); n++)
+        {
+            if (is_free(n))
+                continue;
+
+            const Node& node = m_Nodes[n];
+            size_t items = node.items.size();
+            size_t depth = node.level - m_Level;
+
+            bool leaf = std::all_of(node.children.begin(), node.children.end(), [](Index child) { return child == NONE; });
+
+            stats.nodes++;
+            stats.items += items;
+            stats.maxDepth = std::max(stats.maxDepth, depth);
+
+            if (leaf)
+            {
+                stats.leaves++;
+                leafLevels += depth;
+            }
+            else
+                stats.interiorItems += items;
+
+            size_t bucket = 0;
+
+            while (items >> bucket)
+                bucket++;
+
+            if (stats.itemsHistogram.size() <= bucket)
+                stats.itemsHistogram.resize(bucket + 1);
+
+            stats.itemsHistogram[bucket]++;
+        }
+
+        stats.averageDepth = float(leafLevels) / std::max<size_t>(stats.leaves, 1);
+        stats.bytes = memory_usage();
+
+        return stats;
+    }
+
+    def::rectf item_area(const ItemLocation& location) const
+    {
+        return m_Nodes[location.node].items.area(location.slot);
+    }
+
+    // Z-order path to the quad that would hold the area if every quad was split. Sorting a batch
+    // by it makes the consecutive items go down the same nodes
+    uint64_t path_key(const def::rectf& area) const
+    {
+        return make_key(area, 0).path;
+    }
+
+    // Writes the tree to a file that MappedQuadTree can query without loading it.
+    // convert turns each item into the trivially copyable value that is stored in the file
+    template <class Convert>
+    bool save(const std::string& path, Convert&& convert) const
+    {
+        using Value = std::decay_t<decltype(convert(std::declval<const T&>()))>;
+        static_assert(std::is_trivially_copyable_v<Value>, "Only trivially copyable items can be saved");
+
+        // Depth-first order, the children are pushed backwards so the first one is visited first
+        std::vector<Index> order;
+        std::vector<Index> indices(m_Nodes.size());
+        std::vector<Index> stack = { 0 };
+
+        order.reserve(m_Nodes.size());
+
+        while (!stack.empty())
+        {
+            Index index = stack.back();
+            stack.pop_back();
+
+            indices[index] = Index(order.size());
+            order.push_back(index);
+
+            for (size_t i = 4; i-- > 0;)
+            {
+                if (m_Nodes[index].children[i] != NONE)
+                    stack.push_back(m_Nodes[index].children[i]);
+            }
+        }
+
+        auto align = [](uint64_t offset)
+            {
+                return (offset + QUADTREE_SNAPSHOT_ALIGNMENT - 1) / QUADTREE_SNAPSHOT_ALIGNMENT * QUADTREE_SNAPSHOT_ALIGNMENT;
+            };
+
+        QuadTreeSnapshotHeader header{};
+        std::memcpy(header.magic, QUADTREE_SNAPSHOT_MAGIC, sizeof(header.magic));
+
+        header.version = QUADTREE_SNAPSHOT_VERSION;
+        header.itemSize = sizeof(Value);
+        header.nodesCount = Index(order.size());
+        header.itemsCount = Index(size());
+
+        header.nodesOffset = align(sizeof(header));
+        header.xOffset = align(header.nodesOffset + header.nodesCount * sizeof(QuadTreeSnapshotNode));
+        header.yOffset = align(header.xOffset + header.itemsCount * sizeof(float));
+        header.wOffset = align(header.yOffset + header.itemsCount * sizeof(float));
+        header.hOffset = align(header.wOffset + header.itemsCount * sizeof(float));
+        header.dataOffset = align(header.hOffset + header.itemsCount * sizeof(float));
+        header.fileSize = header.dataOffset + header.itemsCount * sizeof(Value);
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+        if (!file)
+            return false;
+
+        auto write = [&](const void* bytes, size_t count)
+            {
+                file.write((const char*)bytes, count);
+            };
+
+        auto pad_to = [&](uint64_t offset)
+            {
+                static const char zeros[QUADTREE_SNAPSHOT_ALIGNMENT] = {};
+                write(zeros, size_t(offset - (uint64_t)file.tellp()));
+            };
+
+        write(&header, sizeof(header));
+        pad_to(header.nodesOffset);
+
+        Index firstItem = 0;
+
+        for (Index index : order)
+        {
+            const Node& node = m_Nodes[index];
+            QuadTreeSnapshotNode stored{};
+
+            for (size_t i = 0; i < 4; i++)
+            {
+                const def::rectf& area = node.childrenAreas[i];
+
+                stored.childrenAreas[i][0] = area.pos.x;
+                stored.childrenAreas[i][1] = area.pos.y;
+                stored.childrenAreas[i][2] = area.size.x;
+                stored.childrenAreas[i][3] = area.size.y;
+
+                stored.children[i] = node.children[i] == NONE ? NONE : indices[node.children[i]];
+            }
+
+            stored.firstItem = firstItem;
+            stored.itemsCount = Index(node.items.size());
+            stored.count = node.count;
+
+            firstItem += stored.itemsCount;
+            write(&stored, sizeof(stored));
+        }
+
+        // The compact areas are written as floats
+        std::vector<float> values;
+
+        auto write_floats = [&](uint64_t offset, def::vf2d def::rectf::* part, float def::vf2d::* axis)
+            {
+                pad_to(offset);
+
+                for (Index index : order)
+                {
+                    const Items& items = m_Nodes[index].items;
+                    values.resize(items.size());
+
+                    for (size_t slot = 0; slot < items.size(); slot++)
+                        values[slot] = (items.area(slot).*part).*axis;
+
+                    write(values.data(), values.size() * sizeof(float));
+                }
+            };
+
+        write_floats(header.xOffset, &def::rectf::pos, &def::vf2d::x);
+        write_floats(header.yOffset, &def::rectf::pos, &def::vf2d::y);
+        write_floats(header.wOffset, &def::rectf::size, &def::vf2d::x);
+        write_floats(header.hOffset, &def::rectf::size, &def::vf2d::y);
+
+        pad_to(header.dataOffset);
+
+        for (Index index : order)
+        {
+            for (const auto& item : m_Nodes[index].items.data)
+            {
+                Value value = convert(item);
+                write(&value, sizeof(value));
+            }
+        }
+
+        return (bool)file.flush();
+    }
+
+    bool save(const std::string& path) const
+    {
+        return save(path, [](const T& item) { return item; });
+    }
+
+private:
+    // Path of an item from the root, the quad of level N is stored in bits 64 - 2N
+    struct BuildKey
+    {
+        uint64_t path;
+        uint32_t depth;
+        Index index;
+
+        bool operator<(const BuildKey& key) const
+        {
+            if (path != key.path) return path < key.path;
+            if (depth != key.depth) return depth < key.depth;
+            return index < key.index;
+        }
+    };
+
+    static std::array<def::rectf, 4> split(const def::rectf& area)
+    {
+        def::vf2d childSize = area.size * 0.5f;
+
+        return
+        {
+            def::rectf(area.pos, childSize),
+            def::rectf({ area.pos.x + childSize.x, area.pos.y }, childSize),
+            def::rectf({ area.pos.x, area.pos.y + childSize.y }, childSize),
+            def::rectf(area.pos + childSize, childSize)
+        };
+    }
+
+    // Area that can hold the items of a node with the given area
+    def::rectf bounds(const def::rectf& area) const
+    {
+        if constexpr (Loose)
+        {
+            def::vf2d margin = area.size * ((m_Looseness - 1.0f) * 0.5f);
+            return def::rectf(area.pos - margin, area.size + margin * 2.0f);
+        }
+        else
+            return area;
+    }
+
+    // Returns the index of the only child that can contain the area and writes its area
+    // or returns 4 if none of them can. The child is picked by the top-left corner of the area
+    // or by its centre in the loose mode
+    size_t fit(const def::rectf& nodeArea, const def::rectf& area, def::rectf& childArea) const
+    {
+        def::vf2d childSize = nodeArea.size * 0.5f;
+        def::vf2d center = nodeArea.pos + childSize;
+
+        def::vf2d point = Loose ? area.pos + area.size * 0.5f : area.pos;
+
+        size_t i = 0;
+        childArea = def::rectf(nodeArea.pos, childSize);
+
+        if (point.x >= center.x)
+        {
+            childArea.pos.x = center.x;
+            i |= 1;
+        }
+
+        if (point.y >= center.y)
+        {
+            childArea.pos.y = center.y;
+            i |= 2;
+        }
+
+        return def::contains(bounds(childArea), area) ? i : 4;
+    }
+
+    Node make_node(const def::rectf& area, size_t level, Index parent) const
+    {
+        Node node;
+
+        node.area = area;
+        node.childrenAreas = split(area);
+        node.level = level;
+        node.count = 0;
+        node.categoryMask = 0;
+        node.divided = false;
+
+        for (auto& childArea : node.childrenAreas)
+            childArea = bounds(childArea);
+
+        node.children.fill(NONE);
+        node.parent = parent;
+        node.items.set_frame(bounds(area));
+
+        return node;
+    }
+
+    Index allocate(std::vector<Node>& nodes, const def::rectf& area, size_t level, Index parent) const
+    {
+        nodes.push_back(make_node(area, level, parent));
+        return Index(nodes.size() - 1);
+    }
+
+    // Reuses the nodes of the dropped subtrees first
+    Index allocate(const def::rectf& area, size_t level, Index parent)
+    {
+        if (!m_FreeNodes.empty())
+        {
+            Index index = m_FreeNodes.back();
+            m_FreeNodes.pop_back();
+
+            Items items = std::move(m_Nodes[index].items);
+
+            m_Nodes[index] = make_node(area, level, parent);
+            m_Nodes[index].items = std::move(items);
+            m_Nodes[index].items.set_frame(bounds(area));
+
+            return index;
+        }
+
+        m_CategoryCounts.resize(m_CategoryCounts.size() + m_Categories);
+        return allocate(m_Nodes, area, level, parent);
+    }
+
+    // Nodes of the dropped subtrees have no parent, only the root has none otherwise
+    bool is_free(Index node) const
+    {
+        return node != 0 && m_Nodes[node].parent == NONE;
+    }
+
+    // Passes all items of the subtree to erased and puts its nodes on the free list,
+    // they keep the memory of their items for the next use. Returns the number of the items
+    template <class Erased>
+    size_t drop(Index index, Erased& erased)
+    {
+        Node& node = m_Nodes[index];
+        size_t removed = node.items.size();
+
+        for (auto& item : node.items.data)
+            erased(item);
+
+        for (Index child : node.children)
+        {
+            if (child != NONE)
+                removed += drop(child, erased);
+        }
+
+        // The counts of a node must be zero when it's reused
+        std::fill_n(m_CategoryCounts.begin() + index * m_Categories, m_Categories, 0);
+
+        node.items.truncate(0);
+        node.parent = NONE;
+        m_FreeNodes.push_back(index);
+        m_Compacted = false;
+
+        return removed;
+    }
+
+    // Frees the node if its subtree is empty and then its parents that become empty, the root stays
+    void prune(Index index)
+    {
+        auto ignore = [](const T&) {};
+
+        while (index != 0 && m_Nodes[index].count == 0)
+        {
+            Index parent = m_Nodes[index].parent;
+
+            for (Index& child : m_Nodes[parent].children)
+            {
+                if (child == index)
+                    child = NONE;
+            }
+
+            drop(index, ignore);
+            index = parent;
+        }
+    }
+
+    // Moves the last node of the pool to the free slot and tells its owner where the items went
+    template <class Moved>
+    void move_node(Index from, Index to, Moved& moved)
+    {
+        Node& node = m_Nodes[to];
+        node = std::move(m_Nodes[from]);
+
+        for (Index& child : m_Nodes[node.parent].children)
+        {
+            if (child == from)
+                child = to;
+        }
+
+        for (Index child : node.children)
+        {
+            if (child != NONE)
+                m_Nodes[child].parent = to;
+        }
+
+        std::copy_n(m_CategoryCounts.begin() + from * m_Categories, m_Categories, m_CategoryCounts.begin() + to * m_Categories);
+
+        node.items.shrink_to_fit();
+
+        for (Index slot = 0; slot < node.items.size(); slot++)
+            moved(node.items.data[slot], { to, slot });
+
+        m_Nodes.pop_back();
+        m_CategoryCounts.resize(m_Nodes.size() * m_Categories);
+    }
+
+    template <class Erased, class Moved, class Exact>
+    size_t erase_in(Index index, const def::rectf& area, std::vector<Index>& slots, Erased& erased, Moved& moved, Exact& exact)
+    {
+        Items& items = m_Nodes[index].items;
+
+        // Slots come out in increasing order
+        slots.clear();
+
+        items.for_each_overlapping(area.pos, area.pos + area.size, [&](size_t slot)
+            {
+                if (exact(items.data[slot]))
+                    slots.push_back(Index(slot));
+            });
+
+        size_t removed = slots.size();
+
+        // Backwards so the last item is never one of the removed ones
+        // and at most one item is moved for each removed one
+        for (size_t i = slots.size(); i-- > 0;)
+        {
+            erased(items.data[slots[i]]);
+            erase_slot({ index, slots[i] }, moved);
+        }
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            Index child = m_Nodes[index].children[i];
+
+            if (child == NONE)
+                continue;
+
+            if (def::contains(area, m_Nodes[index].childrenAreas[i]))
+            {
+                removed += drop(child, erased);
+                m_Nodes[index].children[i] = NONE;
+            }
+            else if (overlaps(area, m_Nodes[index].childrenAreas[i]))
+            {
+                removed += erase_in(child, area, slots, erased, moved, exact);
+
+                if (m_Nodes[child].count == 0)
+                {
+                    drop(child, erased);
+                    m_Nodes[index].children[i] = NONE;
+                }
+            }
+        }
+
+        m_Nodes[index].count -= Index(removed);
+
+        if (removed > 0)
+        {
+            if (m_Categories > 0)
+                count_categories(index);
+
+            mask_categories(index);
+        }
+
+        return removed;
+    }
+
+    // Takes the category mask of the node from its items and the masks of its children
+    void mask_categories(Index index)
+    {
+        Node& node = m_Nodes[index];
+        node.categoryMask = 0;
+
+        for (uint8_t c : node.items.category)
+            node.categoryMask |= category_bit(c);
+
+        for (Index child : node.children)
+        {
+            if (child != NONE)
+                node.categoryMask |= m_Nodes[child].categoryMask;
+        }
+    }
+
+    // Counts the categories of the node from its items and the counts of its children
+    void count_categories(Index index)
+    {
+        const Node& node = m_Nodes[index];
+        Index* counts = &m_CategoryCounts[index * m_Categories];
+
+        std::fill_n(counts, m_Categories, 0);
+
+        for (uint8_t c : node.items.category)
+        {
+            if (c < m_Categories)
+                counts[c]++;
+        }
+
+        for (Index child : node.children)
+        {
+            if (child != NONE)
+            {
+                for (size_t c = 0; c < m_Categories; c++)
+                    counts[c] += m_CategoryCounts[child * m_Categories + c];
+            }
+        }
+    }
+
+    // Adds delta to the counts of the node and all its parents up to the last node (excluded)
+    void add_count(Index node, Index last, int delta, uint8_t category)
+    {
+        for (; node != last; node = m_Nodes[node].parent)
+        {
+            Node& current = m_Nodes[node];
+            current.count += delta;
+
+            if (category < m_Categories)
+                m_CategoryCounts[node * m_Categories + category] += delta;
+
+            if (delta > 0)
+                current.categoryMask |= category_bit(category);
+
+            else if (current.count == 0)
+                current.categoryMask = 0;
+
+            else if (category < m_Categories && category < 63 && m_CategoryCounts[node * m_Categories + category] == 0)
+                current.categoryMask &= ~category_bit(category);
+        }
+    }
+
+    // Number of items of each category in the subtree, null if the categories aren't counted
+    const Index* category_counts(Index node) const
+    {
+        return m_Categories > 0 ? &m_CategoryCounts[node * m_Categories] : nullptr;
+    }
+
+    template <class Moved>
+    void erase_slot(const ItemLocation& location, Moved& moved)
+    {
+        Items& items = m_Nodes[location.node].items;
+        m_Compacted = false;
+
+        if (location.slot + 1 != items.size())
+        {
+            items.move_back_to(location.slot);
+            moved(items.data[location.slot], location);
+        }
+        else
+            items.pop_back();
+    }
+
+    // A subtree and the items of its parents that reach into it
+    // or two sibling subtrees of the loose tree if other is set
+    struct PairsTask
+    {
+        Index node;
+        size_t depth;
+        Storage above;
+        Index other = NONE;
+    };
+
+    // Reports the pairs of the items in the node and between the items of the node
+    // and the items from above, if tasks is set then the subtrees at PARALLEL_QUERY_DEPTH
+    // are stored there instead of being visited
+    template <class Func>
+    void find_pairs(Index index, size_t depth, const Storage& above,
+        std::vector<Storage>& buffers, Func& func, std::vector<PairsTask>* tasks) const
+    {
+        if (tasks && depth == PARALLEL_QUERY_DEPTH)
+        {
+            tasks->push_back({ index, depth, above });
+            return;
+        }
+
+        const Node& node = m_Nodes[index];
+        const Items& items = node.items;
+
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            def::rectf area = items.area(i);
+
+            for (size_t j = i + 1; j < items.size(); j++)
+            {
+                if (mutually_overlap(area, items.area(j)))
+                    func(items.data[i], items.data[j]);
+            }
+        }
+
+        for (const auto& item : above)
+        {
+            for (size_t j = 0; j < items.size(); j++)
+            {
+                if (mutually_overlap(item.second, items.area(j)))
+                    func(item.first, items.data[j]);
+            }
+        }
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            if (node.children[i] == NONE)
+                continue;
+
+            const def::rectf& childArea = node.childrenAreas[i];
+
+            Storage& next = buffers[depth];
+            next.clear();
+
+            for (const auto& item : above)
+            {
+                if (overlaps(item.second, childArea))
+                    next.push_back(item);
+            }
+
+            for (size_t j = 0; j < items.size(); j++)
+            {
+                def::rectf area = items.area(j);
+
+                if (overlaps(area, childArea))
+                    next.push_back({ items.data[j], area });
+            }
+
+            find_pairs(node.children[i], depth + 1, next, buffers, func, tasks);
+        }
+
+        if constexpr (Loose)
+        {
+            for (size_t i = 0; i < 4; i++)
+            {
+                for (size_t j = i + 1; j < 4; j++)
+                {
+                    if (node.children[i] == NONE || node.children[j] == NONE ||
+                        !overlaps(node.childrenAreas[i], node.childrenAreas[j]))
+                        continue;
+
+                    if (tasks)
+                        tasks->push_back({ node.children[i], depth + 1, Storage(), node.children[j] });
+                    else
+                        find_cross_pairs(node.children[i], node.children[j], func);
+                }
+            }
+        }
+    }
+
+    // Reports the pairs between the subtree of a and the subtree of b
+    template <class Func>
+    void find_cross_pairs(Index a, Index b, Func& func) const
+    {
+        const Node& node = m_Nodes[a];
+        const def::rectf otherBounds = bounds(m_Nodes[b].area);
+
+        for (size_t i = 0; i < node.items.size(); i++)
+        {
+            def::rectf area = node.items.area(i);
+
+            if (overlaps(area, otherBounds))
+                find_pairs_with(b, area, node.items.data[i], func);
+        }
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            if (node.children[i] != NONE && overlaps(node.childrenAreas[i], otherBounds))
+                find_cross_pairs(node.children[i], b, func);
+        }
+    }
+
+    // Reports the pairs between one item and the items of the subtree
+    template <class Func>
+    void find_pairs_with(Index index, const def::rectf& area, const T& item, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+
+        for (size_t j = 0; j < node.items.size(); j++)
+        {
+            if (mutually_overlap(area, node.items.area(j)))
+                func(item, node.items.data[j]);
+        }
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            if (node.children[i] != NONE && overlaps(area, node.childrenAreas[i]))
+                find_pairs_with(node.children[i], area, item, func);
+        }
+    }
+
+    // Tests the items of the top nodes and collects the subtrees that the area overlaps
+    template <class Func>
+    void gather_tasks(Index index, size_t depth, const def::rectf& area,
+        std::vector<std::pair<Index, bool>>& tasks, size_t& expected, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+
+        if (depth == PARALLEL_QUERY_DEPTH)
+        {
+            tasks.push_back({ index, false });
+            expected += node.count;
+            return;
+        }
+
+        find_items(node.items, area, func);
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            Index child = node.children[i];
+
+            if (child == NONE)
+                continue;
+
+            if (def::contains(area, node.childrenAreas[i]))
+            {
+                tasks.push_back({ child, true });
+                expected += m_Nodes[child].count;
+            }
+            else if (overlaps(area, node.childrenAreas[i]))
+                gather_tasks(child, depth + 1, area, tasks, expected, func);
+        }
+    }
+
+    // Children of the node that the ray enters before maxDistance,
+    // sorted by the distance to the entry point. Returns their number
+    size_t children_along(const Node& node, const Ray& ray, float maxDistance,
+        std::array<std::pair<float, Index>, 4>& children) const
+    {
+        size_t count = 0;
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            float distance;
+
+            if (node.children[i] == NONE || !ray_enters(ray, node.childrenAreas[i], maxDistance, distance))
+                continue;
+
+            // Insertion sort, there are at most 4 of them
+            size_t j = count++;
+
+            for (; j > 0 && children[j - 1].first > distance; j--)
+                children[j] = children[j - 1];
+
+            children[j] = { distance, node.children[i] };
+        }
+
+        return count;
+    }
+
+    // Calls func(slot, distance) for the items of the node hit by the ray before maxDistance.
+    // Only the items that overlap the bounding box of the segment get the exact test
+    template <class Func>
+    static void items_along(const Items& items, const Ray& ray, float maxDistance, Func&& func)
+    {
+        def::vf2d low, high;
+        ray.bounds(maxDistance, low, high);
+
+        items.for_each_overlapping(low, high, [&](size_t slot)
+            {
+                float distance;
+
+                if (ray_enters(ray, items.area(slot), maxDistance, distance))
+                    func(slot, distance);
+            });
+    }
+
+    void raycast(Index index, const Ray& ray, float& closest, T& item, bool& hit) const
+    {
+        const Node& node = m_Nodes[index];
+
+        items_along(node.items, ray, closest, [&](size_t slot, float distance)
+            {
+                if (!hit || distance < closest)
+                {
+                    closest = distance;
+                    item = node.items.data[slot];
+                    hit = true;
+                }
+            });
+
+        std::array<std::pair<float, Index>, 4> children;
+        size_t count = children_along(node, ray, closest, children);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            // Everything in the child is at least as far as its edge
+            if (hit && children[i].first >= closest)
+                break;
+
+            raycast(children[i].second, ray, closest, item, hit);
+        }
+    }
+
+    void raycast(Index index, const Ray& ray, float maxDistance, std::vector<std::pair<T, float>>& result) const
+    {
+        const Node& node = m_Nodes[index];
+
+        items_along(node.items, ray, maxDistance, [&](size_t slot, float distance)
+            {
+                result.push_back({ node.items.data[slot], distance });
+            });
+
+        std::array<std::pair<float, Index>, 4> children;
+        size_t count = children_along(node, ray, maxDistance, children);
+
+        for (size_t i = 0; i < count; i++)
+            raycast(children[i].second, ray, maxDistance, result);
+    }
+
+    // Goes down from the node as far as the area fits within the children of the split nodes
+    // and returns the index of the last node, creates the missing nodes
+    Index descend(Index node, const def::rectf& area)
+    {
+        def::rectf childArea;
+        size_t i;
+
+        while (m_Nodes[node].divided && (i = fit(m_Nodes[node].area, area, childArea)) < 4)
+        {
+            if (m_Nodes[node].children[i] == NONE)
+            {
+                // Don't hold references to the nodes here
+                // because the pool can grow
+                Index child = allocate(childArea, m_Nodes[node].level + 1, node);
+                m_Nodes[node].children[i] = child;
+            }
+
+            node = m_Nodes[node].children[i];
+        }
+
+        // It fits within the area of the current child
+        // but it doesn't fit within any area of the children
+        // so stop here
+        return node;
+    }
+
+    bool can_divide(size_t level, const def::rectf& area) const
+    {
+        return level - m_Level < m_Subdivision.maxDepth &&
+            std::max(area.size.x, area.size.y) * 0.5f >= m_Subdivision.minNodeSize;
+    }
+
+    // Whether the leaf is split before it gets the incoming items
+    bool should_divide(Index index, size_t incoming) const
+    {
+        const Node& node = m_Nodes[index];
+
+        return !node.divided && node.items.size() + incoming > m_Subdivision.splitThreshold &&
+            can_divide(node.level, node.area);
+    }
+
+    // Splits the leaf and pushes its items that fit in the children down,
+    // the children that end up with too many items are split in turn
+    template <class Moved>
+    void divide(Index index, Moved& moved)
+    {
+        m_Nodes[index].divided = true;
+
+        // Backwards so the item that fills a freed slot has been visited already
+        for (size_t slot = m_Nodes[index].items.size(); slot-- > 0;)
+        {
+            def::rectf area = m_Nodes[index].items.area(slot);
+            Index node = descend(index, area);
+
+            if (node == index)
+                continue;
+
+            // The pool could have grown so the references are taken after descend()
+            Items& items = m_Nodes[index].items;
+            Items& target = m_Nodes[node].items;
+
+            uint8_t category = items.category[slot];
+            add_count(node, index, 1, category);
+
+            target.push_back(std::move(items.data[slot]), area, category);
+            moved(target.data.back(), { node, Index(target.size() - 1) });
+
+            erase_slot({ index, Index(slot) }, moved);
+        }
+
+        std::array<Index, 4> children = m_Nodes[index].children;
+
+        for (Index child : children)
+        {
+            if (child != NONE && should_divide(child, 0))
+                divide(child, moved);
+        }
+    }
+
+    // Cuts the paths of the sorted keys of a subtree at the nodes that aren't split
+    // so their items stay together in the leaf. depth is the depth of the subtree's root
+    void limit_keys(BuildKey* first, BuildKey* last, uint32_t depth, const def::rectf& area) const
+    {
+        if (size_t(last - first) > m_Subdivision.splitThreshold && depth < MAX_BUILD_DEPTH && can_divide(m_Level + depth, area))
+        {
+            // The keys of the node come first and then the ones of each child
+            while (first != last && first->depth == depth)
+                first++;
+
+            std::array<def::rectf, 4> childrenAreas = split(area);
+
+            for (size_t i = 0; i < 4; i++)
+            {
+                BuildKey* end = std::partition_point(first, last,
+                    [&](const BuildKey& key) { return ((key.path >> (62 - 2 * depth)) & 3) <= i; });
+
+                limit_keys(first, end, depth + 1, childrenAreas[i]);
+                first = end;
+            }
+
+            return;
+        }
+
+        uint64_t mask = depth == 0 ? 0 : ~uint64_t(0) << (64 - 2 * depth);
+
+        for (; first != last; first++)
+        {
+            first->path &= mask;
+            first->depth = depth;
+        }
+    }
+
+    // Follows the same steps as insert() but without touching the nodes
+    BuildKey make_key(const def::rectf& area, Index index) const
+    {
+        BuildKey key{ 0, 0, index };
+
+        def::rectf nodeArea = m_Area;
+        def::rectf childArea;
+
+        while (key.depth < MAX_BUILD_DEPTH)
+        {
+            size_t i = fit(nodeArea, area, childArea);
+
+            if (i == 4)
+                break;
+
+            key.depth++;
+            key.path |= uint64_t(i) << (64 - 2 * key.depth);
+
+            nodeArea = childArea;
+        }
+
+        return key;
+    }
+
+    static size_t quadrant_of(const BuildKey& key)
+    {
+        return key.depth == 0 ? 0 : size_t(key.path >> 62) + 1;
+    }
+
+    // Creates the nodes for the sorted keys, nodes[0] is the node at the depth of rootDepth
+    template <class Categorize>
+    void build(std::vector<Node>& nodes, const BuildKey* first, const BuildKey* last, uint32_t rootDepth,
+        const Storage& items, Categorize& category) const
+    {
+        if (first == last)
+            return;
+
+        // Nodes on the path to the current key
+        std::array<Index, MAX_BUILD_DEPTH + 1> stack;
+        stack[rootDepth] = 0;
+
+        uint32_t depth = rootDepth;
+        uint64_t path = first->path;
+
+        while (first != last)
+        {
+            const BuildKey* run = first;
+
+            while (run != last && run->path == first->path && run->depth == first->depth)
+                run++;
+
+            // Go up to the last common node and then down to the node of the key
+            uint32_t common = rootDepth;
+
+            while (common < depth && common < first->depth &&
+                ((path ^ first->path) >> (62 - 2 * common) & 3) == 0)
+                common++;
+
+            for (depth = common; depth < first->depth; depth++)
+            {
+                size_t i = (first->path >> (62 - 2 * depth)) & 3;
+                Index node = stack[depth];
+
+                if (nodes[node].children[i] == NONE)
+                {
+                    Index child = allocate(nodes, split(nodes[node].area)[i], nodes[node].level + 1, node);
+                    nodes[node].children[i] = child;
+                    nodes[node].divided = true;
+                }
+
+                stack[depth + 1] = nodes[node].children[i];
+            }
+
+            path = first->path;
+
+            Items& nodeItems = nodes[stack[depth]].items;
+            nodeItems.reserve(nodeItems.size() + (run - first));
+
+            for (; first != run; first++)
+            {
+                const auto& item = items[first->index];
+                nodeItems.push_back(item.first, item.second, category(item.first));
+            }
+        }
+    }
+
+    template <class Func>
+    static void find_items(const Items& items, const def::rectf& area, Func& func)
+    {
+#ifdef QUADTREES_QUERY_STATS
+        size_t found = 0;
+
+        items.for_each_overlapping(area.pos, area.pos + area.size, [&](size_t slot) { found++; func(items.data[slot]); });
+
+        count_query(1, items.size(), found);
+#else
+        items.for_each_overlapping(area.pos, area.pos + area.size, [&](size_t slot) { func(items.data[slot]); });
+#endif
+    }
+
+    template <class Func>
+    void find(Index index, const def::rectf& area, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+
+        find_items(node.items, area, func);
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            if (node.children[i] != NONE)
+            {
+                if (def::contains(area, node.childrenAreas[i]))
+                    collect_items(node.children[i], func);
+
+                else if (overlaps(area, node.childrenAreas[i]))
+                    find(node.children[i], area, func);
+            }
+        }
+    }
+
+    template <class Func>
+    static void find_items(const Items& items, const def::rectf& area, uint64_t categories, Func& func)
+    {
+        size_t found = 0;
+
+        items.for_each_overlapping(area.pos, area.pos + area.size, [&](size_t slot)
+            {
+                if (category_bit(items.category[slot]) & categories)
+                {
+                    found++;
+                    func(items.data[slot]);
+                }
+            });
+
+        count_query(1, items.size(), found);
+    }
+
+    template <class Func>
+    void find(Index index, const def::rectf& area, uint64_t categories, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+
+        find_items(node.items, area, categories, func);
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            Index child = node.children[i];
+
+            if (child == NONE || (m_Nodes[child].categoryMask & categories) == 0)
+                continue;
+
+            if (def::contains(area, node.childrenAreas[i]))
+                collect_items(child, categories, func);
+
+            else if (overlaps(area, node.childrenAreas[i]))
+                find(child, area, categories, func);
+        }
+    }
+
+    template <class Func, class Tile>
+    void find_lod(Index index, const def::rectf& area, float minSize, Func& func, Tile& tile) const
+    {
+        const Node& node = m_Nodes[index];
+
+        if (std::max(node.area.size.x, node.area.size.y) <= minSize)
+        {
+            if (node.count > 0)
+                tile(node.area, size_t(node.count), category_counts(index));
+
+            return;
+        }
+
+        find_items(node.items, area, func);
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            if (node.children[i] != NONE && overlaps(area, node.childrenAreas[i]))
+                find_lod(node.children[i], area, minSize, func, tile);
+        }
+    }
+
+    template <class Func>
+    void find_nodes(Index index, const def::rectf& area, size_t maxDepth, float minSize, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+        size_t depth = node.level - m_Level;
+
+        func(node.area, depth, node.items.size(), size_t(node.count));
+
+        if (depth >= maxDepth || std::max(node.area.size.x, node.area.size.y) <= minSize)
+            return;
+
+        for (Index child : node.children)
+        {
+            if (child != NONE && overlaps(area, m_Nodes[child].area))
+                find_nodes(child, area, maxDepth, minSize, func);
+        }
+    }
+
+    template <class Func>
+    void collect_items(Index index, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+        count_query(1, 0, node.items.size());
+
+        for (const auto& item : node.items.data)
+            func(item);
+
+        for (Index child : node.children)
+        {
+            if (child != NONE)
+                collect_items(child, func);
+        }
+    }
+
+    template <class Func>
+    void collect_items(Index index, uint64_t categories, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+        size_t found = 0;
+
+        for (size_t slot = 0; slot < node.items.size(); slot++)
+        {
+            if (category_bit(node.items.category[slot]) & categories)
+            {
+                found++;
+                func(node.items.data[slot]);
+            }
+        }
+
+        count_query(1, node.items.size(), found);
+
+        for (Index child : node.children)
+        {
+            if (child != NONE && (m_Nodes[child].categoryMask & categories))
+                collect_items(child, categories, func);
+        }
+    }
+
+private:
+    size_t m_Level;
+
+    def::rectf m_Area;
+
+    float m_Looseness = 2.0f;
+
+    // All nodes of the tree in one contiguous pool, the root is the first one
+    std::vector<Node> m_Nodes;
+
+    // Nodes of the dropped subtrees that can be reused
+    std::vector<Index> m_FreeNodes;
+
+    // Nodes which items compact() has trimmed so far and whether
+    // any item was removed since it last finished
+    size_t m_Trimmed = 0;
+    bool m_Compacted = true;
+
+    QuadTreeSubdivision m_Subdivision;
+
+    // Counts of every category for each node, m_Categories per node in the order of the pool
+    size_t m_Categories = 0;
+    std::vector<Index> m_CategoryCounts;
+};
+
+template <class T, bool Loose = false, bool Compact = false>
+class QuadTreeContainer
+{
+public:
+    struct Item;
+
+    using Storage = std::list<Item>;
+    using Tree = QuadTree<typename Storage::iterator, Loose, Compact>;
+    using ItemLocation = typename Tree::ItemLocation;
+
+    struct Item
+    {
+        T data;
+        ItemLocation location;
+
+        // Index of the item's recorded change waiting for commit()
+        uint32_t command = NONE;
+    };
+
+    static constexpr uint32_t NONE = Tree::NONE;
+
+    QuadTreeContainer(const def::rectf& area = { {0.0f, 0.0f}, {128.0f, 128.0f} }, size_t level = 0)
+    {
+        create(area, level);
+    } 
+
+    void create(const def::rectf& area = { {0.0f, 0.0f}, {128.0f, 128.0f} }, size_t level = 0)
+    {
+        m_Root.create(area, level);
+        clear();
+    }
+
+    void clear()
+    {
+        m_Root.clear();
+        m_Items.clear();
+        m_Pending.clear();
+        m_Commands.clear();
+        m_Version++;
+    }
+
+    // Only used by the loose tree, clears the container
+    void set_looseness(float looseness)
+    {
+        m_Root.set_looseness(looseness);
+        clear();
+    }
+
+    // Number of categories counted in every subtree for find_lod(), clears the container.
+    // The items of the categories from the count on aren't counted, see QuadTree::set_categories()
+    void set_categories(size_t count)
+    {
+        m_Root.set_categories(count);
+        clear();
+    }
+
+    // When the nodes are split, clears the container
+    void set_subdivision(const QuadTreeSubdivision& subdivision)
+    {
+        m_Root.set_subdivision(subdivision);
+        clear();
+    }
+
+    // Changes every time the items or their areas change
+    size_t version() const
+    {
+        return m_Version;
+    }
+
+    size_t size() const
+    {
+        return m_Items.size();
+    }
+
+    void insert(const T& item, const def::rectf& area, uint8_t category = 0)
+    {
+        m_Items.push_back({ item, ItemLocation(), NONE });
+        m_Items.back().location = m_Root.insert(std::prev(m_Items.end()), area, category, update_location);
+        m_Version++;
+    }
+
+    void find(const def::rectf& area, std::list<typename Storage::iterator>& data) const
+    {
+        m_Root.find(area, data);
+    }
+
+    void find(const def::rectf& area, std::vector<typename Storage::iterator>& data) const
+    {
+        m_Root.find(area, data);
+    }
+
+    template <class Func>
+    void find(const def::rectf& area, Func&& func) const
+    {
+        m_Root.find(area, func);
+    }
+
+    void find(const def::rectf& area, uint64_t categories, std::vector<typename Storage::iterator>& data) const
+    {
+        m_Root.find(area, categories, data);
+    }
+
+    // Only the items of the categories which bits are set, see QuadTree::category_bit()
+    template <class Func>
+    void find(const def::rectf& area, uint64_t categories, Func&& func) const
+    {
+        m_Root.find(area, categories, func);
+    }
+
+    void find_parallel(const def::rectf& area, std::vector<typename Storage::iterator>& data,
+        size_t threshold = Tree::PARALLEL_QUERY_THRESHOLD) const
+    {
+        m_Root.find_parallel(area, data, threshold);
+    }
+
+    // Passes the subtrees not bigger than minSize to tile(area, count, categories) instead of their items
+    template <class Func, class Tile>
+    void find_lod(const def::rectf& area, float minSize, Func&& func, Tile&& tile) const
+    {
+        m_Root.find_lod(area, minSize, func, tile);
+    }
+
+    void nearest(const def::vf2d& point, size_t k, float maxDistance,
+        std::vector<std::pair<typename Storage::iterator, float>>& result) const
+    {
+        m_Root.nearest(point, k, maxDistance, result);
+    }
+
+    bool nearest(const def::vf2d& point, typename Storage::iterator& item,
+        float maxDistance = std::numeric_limits<float>::max()) const
+    {
+        return m_Root.nearest(point, item, maxDistance);
+    }
+
+    bool raycast(const def::vf2d& origin, const def::vf2d& direction, float maxDistance,
+        typename Storage::iterator& item, float& distance) const
+    {
+        return m_Root.raycast(origin, direction, maxDistance, item, distance);
+    }
+
+    void raycast(const def::vf2d& origin, const def::vf2d& direction, float maxDistance,
+        std::vector<std::pair<typename Storage::iterator, float>>& result) const
+    {
+        m_Root.raycast(origin, direction, maxDistance, result);
+    }
+
+    // Calls func(a, b) with the iterators of every pair of overlapping items once
+    template <class Func>
+    void for_each_overlapping_pair(Func&& func, bool parallel = false) const
+    {
+        m_Root.for_each_overlapping_pair(func, parallel);
+    }
+
+    // Replaces the content of the container with a batch of { item, area } pairs,
+    // category(item) gives the category of each item when the categories are counted
+    template <class Range, class Categorize = typename Tree::NoCategory>
+    void build(const Range& items, bool parallel = false, Categorize&& category = Categorize())
+    {
+        clear();
+
+        typename Tree::Storage batch;
+        batch.reserve(std::distance(std::begin(items), std::end(items)));
+
+        for (const auto& item : items)
+        {
+            m_Items.push_back({ item.first, ItemLocation(), NONE });
+            batch.push_back({ std::prev(m_Items.end()), item.second });
+        }
+
+        m_Root.build(batch, parallel, update_location,
+            [&](const typename Storage::iterator& item) { return category(item->data); });
+
+        m_Version++;
+    }
+
+    // Returns false for an item of defer_insert() before the commit, use defer_relocate() for it.
+    // A recorded move of the item is dropped, a recorded removal still happens
+    bool relocate(typename Storage::iterator item, const def::rectf& area)
+    {
+        if (item->location.node == NONE)
+            return false;
+
+        if (item->command != NONE && m_Commands[item->command].type == Command::Relocate)
+            cancel_command(item);
+
+        item->location = m_Root.relocate(item->location, area, update_location);
+        m_Version++;
+
+        return true;
+    }
+
+    // Returns false for an item of defer_insert() before the commit, use defer_remove() for it
+    bool remove(typename Storage::iterator item)
+    {
+        if (item->location.node == NONE)
+            return false;
+
+        cancel_command(item);
+        m_Root.erase(item->location, update_location);
+
+        m_Items.erase(item);
+        m_Version++;
+
+        return true;
+    }
+
+    // Removes every item that overlaps the area, returns their number.
+    // The items of defer_insert() aren't in the tree until the commit so they stay
+    size_t erase_in(const def::rectf& area)
+    {
+        static_assert(!Compact, "The compact container needs exact(item) to tell the real areas");
+
+        return erase_in(area, [](const T&) { return true; });
+    }
+
+    // Only removes the items for which exact(item) is true among the ones that may overlap the area,
+    // the compact container keeps rounded areas so it's the only exact way to erase its items
+    template <class Exact>
+    size_t erase_in(const def::rectf& area, Exact&& exact)
+    {
+        size_t removed = m_Root.erase_in(area,
+            [&](typename Storage::iterator& item)
+            {
+                cancel_command(item);
+                m_Items.erase(item);
+            }, update_location,
+            [&](const typename Storage::iterator& item) { return exact(item->data); });
+
+        if (removed > 0)
+            m_Version++;
+
+        return removed;
+    }
+
+    // Records an insert that commit() applies, the queries don't see the item until then.
+    // The handle is valid right away so the item can be moved or removed before the commit
+    typename Storage::iterator defer_insert(const T& item, const def::rectf& area, uint8_t category = 0)
+    {
+        m_Pending.push_back({ item, ItemLocation(), NONE });
+        auto handle = std::prev(m_Pending.end());
+
+        handle->command = uint32_t(m_Commands.size());
+        m_Commands.push_back({ Command::Insert, handle, area, category });
+
+        return handle;
+    }
+
+    // Moves the item of a recorded removal instead of removing it
+    void defer_relocate(typename Storage::iterator item, const def::rectf& area)
+    {
+        if (item->command == NONE)
+        {
+            item->command = uint32_t(m_Commands.size());
+            m_Commands.push_back({ Command::Relocate, item, area });
+            return;
+        }
+
+        Command& command = m_Commands[item->command];
+
+        if (command.type == Command::Remove)
+            command.type = Command::Relocate;
+
+        command.area = area;
+    }
+
+    void defer_remove(typename Storage::iterator item)
+    {
+        if (item->command == NONE)
+        {
+            item->command = uint32_t(m_Commands.size());
+            m_Commands.push_back({ Command::Remove, item, def::rectf() });
+        }
+        else if (m_Commands[item->command].type == Command::Insert)
+        {
+            // Never reaches the tree
+            cancel_command(item);
+            m_Pending.erase(item);
+        }
+        else
+            m_Commands[item->command].type = Command::Remove;
+    }
+
+    // Applies the recorded changes at once, the tree doesn't change between the commits.
+    // Each item keeps only its last change as they are recorded. The removals go first,
+    // then the moves and then the inserts. The removals are sorted by the node the item is in
+    // and the inserts by the path to their node, so the consecutive ones touch the same nodes.
+    // The moves keep their order, sorting them cost more than it saved
+    void commit()
+    {
+        if (m_Commands.empty())
+            return;
+
+        auto first = m_Commands.begin();
+
+        auto moves = std::partition(first, m_Commands.end(),
+            [](const Command& command) { return command.type == Command::Remove; });
+
+        auto inserts = std::partition(moves, m_Commands.end(),
+            [](const Command& command) { return command.type == Command::Relocate; });
+
+        auto last = std::partition(inserts, m_Commands.end(),
+            [](const Command& command) { return command.type == Command::Insert; });
+
+        for (auto command = first; command != moves; ++command)
+            command->key = command->item->location.node;
+
+        for (auto command = inserts; command != last; ++command)
+            command->key = m_Root.path_key(command->area);
+
+        auto by_key = [](const Command& a, const Command& b) { return a.key < b.key; };
+
+        std::sort(first, moves, by_key);
+        std::sort(inserts, last, by_key);
+
+        for (auto command = first; command != moves; ++command)
+        {
+            m_Root.erase(command->item->location, update_location);
+            m_Items.erase(command->item);
+        }
+
+        for (auto command = moves; command != inserts; ++command)
+        {
+            auto& item = command->item;
+
+            item->location = m_Root.relocate(item->location, command->area, update_location);
+            item->command = NONE;
+        }
+
+        for (auto command = inserts; command != last; ++command)
+        {
+            auto& item = command->item;
+
+            item->location = m_Root.insert(item, command->area, command->category, update_location);
+            item->command = NONE;
+        }
+
+        m_Items.splice(m_Items.end(), m_Pending);
+
+        m_Commands.clear();
+        m_Version++;
+    }
+
+    // Makes the node pool dense again after mass removals, see QuadTree::compact()
+    bool compact(std::chrono::microseconds budget = std::chrono::microseconds::max())
+    {
+        return m_Root.compact(budget, update_location);
+    }
+
+    def::rectf item_area(typename Storage::iterator item) const
+    {
+        return m_Root.item_area(item->location);
+    }
+
+    // Saves the items themselves so the file can be opened by MappedQuadTree<T>
+    bool save(const std::string& path) const
+    {
+        return m_Root.save(path, [](const typename Storage::iterator& item) { return item->data; });
+    }
+
+    void collect_items(std::list<typename Storage::iterator>& items) const
+    {
+        m_Root.collect_items(items);
+    }
+
+    // Bytes allocated by the tree and the items, counts two pointers per node of the list
+    size_t memory_usage() const
+    {
+        return sizeof(*this) + m_Root.memory_usage() + m_Items.size() * (sizeof(Item) + 2 * sizeof(void*));
+    }
+
+    // Shape of the tree, the bytes include the items
+    typename Tree::Stats stats() const
+    {
+        typename Tree::Stats stats = m_Root.stats();
+        stats.bytes = memory_usage();
+
+        return stats;
+    }
+
+    void collect_areas(std::list<def::rectf>& areas) const
+    {
+        m_Root.collect_areas(areas);
+    }
+
+    // Nodes in the area for a debug overlay, see QuadTree::find_nodes()
+    template <class Func>
+    void find_nodes(const def::rectf& area, size_t maxDepth, float minSize, Func&& func) const
+    {
+        m_Root.find_nodes(area, maxDepth, minSize, func);
+    }
+
+private:
+    // Keeps the location of an item valid when the tree moves it to another slot
+    static void update_location(typename Storage::iterator& item, const ItemLocation& location)
+    {
+        item->location = location;
+    }
+
+    // Drops the recorded change of the item so commit() skips it
+    void cancel_command(typename Storage::iterator item)
+    {
+        if (item->command != NONE)
+        {
+            m_Commands[item->command].type = Command::Cancelled;
+            item->command = NONE;
+        }
+    }
+
+    struct Command
+    {
+        enum Type { Insert, Relocate, Remove, Cancelled } type;
+
+        typename Storage::iterator item;
+        def::rectf area;
+        uint8_t category = 0;
+
+        // Order of the changes of each kind, only set by commit()
+        uint64_t key = 0;
+    };
+
+private:
+    Storage m_Items;
+    Tree m_Root;
+
+    // Items of the recorded inserts, moved to m_Items by commit()
+    Storage m_Pending;
+    std::vector<Command> m_Commands;
+
+    size_t m_Version = 0;
+
+};
+
+// Keeps the result of the previous query and when the area moves only queries
+// the strips that became visible and drops the items that left the area.
+// Any change of the container makes the next update run a full query
+template <class Container>
+class QuadTreeQueryCache
+{
+public:
+    using Handle = typename Container::Storage::iterator;
+
+    const std::vector<Handle>& update(const Container& tree, const def::rectf& area)
+    {
+        if (!m_Valid || m_Tree != &tree || m_Version != tree.version() || !overlaps(area, m_Area))
+        {
+            m_Items.clear();
+            tree.find(area, m_Items);
+
+            m_Tree = &tree;
+            m_Version = tree.version();
+            m_Area = area;
+            m_Valid = true;
+
+            return m_Items;
+        }
+
+        if (area.pos == m_Area.pos && area.size == m_Area.size)
+            return m_Items;
+
+        m_Items.erase(std::remove_if(m_Items.begin(), m_Items.end(),
+            [&](const Handle& item) { return !overlaps(area, tree.item_area(item)); }), m_Items.end());
+
+        std::array<def::rectf, 4> strips;
+        size_t stripsCount = exposed_strips(m_Area, area, strips);
+
+        for (size_t i = 0; i < stripsCount; i++)
+        {
+            tree.find(strips[i], [&](const Handle& item)
+                {
+                    const def::rectf& itemArea = tree.item_area(item);
+
+                    // Was visible before or was found in one of the previous strips
+                    if (overlaps(m_Area, itemArea))
+                        return;
+
+                    for (size_t j = 0; j < i; j++)
+                    {
+                        if (overlaps(strips[j], itemArea))
+                            return;
+                    }
+
+                    m_Items.push_back(item);
+                });
+        }
+
+        m_Area = area;
+
+        return m_Items;
+    }
+
+    void invalidate()
+    {
+        m_Valid = false;
+    }
+
+    const std::vector<Handle>& items() const
+    {
+        return m_Items;
+    }
+
+private:
+    // Splits the part of the current area that is outside of the previous one
+    // into strips above, below, to the left and to the right of the previous area
+    static size_t exposed_strips(const def::rectf& previous, const def::rectf& current, std::array<def::rectf, 4>& strips)
+    {
+        float left = current.pos.x, right = current.pos.x + current.size.x;
+        float top = current.pos.y, bottom = current.pos.y + current.size.y;
+
+        float innerLeft = std::max(left, previous.pos.x);
+        float innerRight = std::min(right, previous.pos.x + previous.size.x);
+        float innerTop = std::max(top, previous.pos.y);
+        float innerBottom = std::min(bottom, previous.pos.y + previous.size.y);
+
+        size_t count = 0;
+
+        if (top < innerTop)
+            strips[count++] = def::rectf({ left, top }, { right - left, innerTop - top });
+
+        if (innerBottom < bottom)
+            strips[count++] = def::rectf({ left, innerBottom }, { right - left, bottom - innerBottom });
+
+        if (left < innerLeft)
+            strips[count++] = def::rectf({ left, innerTop }, { innerLeft - left, innerBottom - innerTop });
+
+        if (innerRight < right)
+            strips[count++] = def::rectf({ innerRight, innerTop }, { right - innerRight, innerBottom - innerTop });
+
+        return count;
+    }
+
+private:
+    std::vector<Handle> m_Items;
+
+    const Container* m_Tree = nullptr;
+    size_t m_Version = 0;
+
+    def::rectf m_Area;
+    bool m_Valid = false;
+
+};
+
+// Tree that one thread changes while other threads query it. There are two copies of the tree,
+// the readers use the front one and the writer changes the back one. publish() swaps them, waits
+// for the readers that are still on the old front and replays the changes on it. The readers never
+// wait for the writer and see the tree as it was at the last publish(), at the cost of twice the memory
+template <class T, bool Loose = false>
+class QuadTreeDoubleBuffer
+{
+public:
+    using Handle = uint32_t;
+
+    // Items of the trees know their handle so the writer can follow them when they are moved
+    struct Entry
+    {
+        Handle handle;
+        T data;
+    };
+
+    using Tree = QuadTree<Entry, Loose>;
+    using ItemLocation = typename Tree::ItemLocation;
+
+    QuadTreeDoubleBuffer(const def::rectf& area = { {0.0f, 0.0f}, {128.0f, 128.0f} }, size_t level = 0)
+    {
+        create(area, level);
+    }
+
+    // Called by the writer while nobody reads
+    void create(const def::rectf& area, size_t level = 0)
+    {
+        for (auto& tree : m_Trees)
+            tree.create(area, level);
+
+        m_Locations.clear();
+        m_FreeHandles.clear();
+        m_Changes.clear();
+    }
+
+    // Called by the writer while nobody reads, clears the trees
+    void set_subdivision(const QuadTreeSubdivision& subdivision)
+    {
+        for (auto& tree : m_Trees)
+            tree.set_subdivision(subdivision);
+
+        m_Locations.clear();
+        m_FreeHandles.clear();
+        m_Changes.clear();
+    }
+
+    // The writer's changes show up after the next publish()
+    Handle insert(const T& item, const def::rectf& area, uint8_t category = 0)
+    {
+        Handle handle;
+
+        if (!m_FreeHandles.empty())
+        {
+            handle = m_FreeHandles.back();
+            m_FreeHandles.pop_back();
+        }
+        else
+        {
+            handle = Handle(m_Locations.size());
+            m_Locations.emplace_back();
+        }
+
+        record({ Change::Insert, handle, area, category, item });
+        return handle;
+    }
+
+    void relocate(Handle handle, const def::rectf& area)
+    {
+        record({ Change::Relocate, handle, area });
+    }
+
+    // The handle can be given to the next insert right away
+    void remove(Handle handle)
+    {
+        record({ Change::Remove, handle });
+        m_FreeHandles.push_back(handle);
+    }
+
+    // Makes the changes since the last call visible to the readers
+    void publish()
+    {
+        size_t front = 1 - m_Front.load();
+        m_Front.store(front);
+
+        // The readers that came before the swap can still be on the old front
+        while (m_Readers[1 - front].count.load() != 0)
+            std::this_thread::yield();
+
+        for (const auto& change : m_Changes)
+            apply(1 - front, change);
+
+        m_Changes.clear();
+    }
+
+    // The tree with all of the writer's changes, only for the writer
+    const Tree& latest() const
+    {
+        return m_Trees[1 - m_Front.load()];
+    }
+
+    // Calls func(tree) with the front tree, which doesn't change until func returns.
+    // Any number of threads can read at the same time
+    template <class Func>
+    void read(Func&& func) const
+    {
+        size_t front;
+
+        while (true)
+        {
+            front = m_Front.load();
+            m_Readers[front].count++;
+
+            // The writer could have swapped the trees in between and be changing this one already
+            if (m_Front.load() == front)
+                break;
+
+            m_Readers[front].count--;
+        }
+
+        struct Leave
+        {
+            std::atomic<size_t>& count;
+            ~Leave() { count--; }
+        } leave{ m_Readers[front].count };
+
+        func(m_Trees[front]);
+    }
+
+    template <class Func>
+    void find(const def::rectf& area, Func&& func) const
+    {
+        read([&](const Tree& tree) { tree.find(area, [&](const Entry& entry) { func(entry.data); }); });
+    }
+
+    void find(const def::rectf& area, std::vector<T>& data) const
+    {
+        find(area, [&](const T& item) { data.push_back(item); });
+    }
+
+    size_t size() const
+    {
+        size_t count = 0;
+        read([&](const Tree& tree) { count = tree.size(); });
+
+        return count;
+    }
+
+private:
+    struct Change
+    {
+        enum Type { Insert, Relocate, Remove } type;
+
+        Handle handle;
+        def::rectf area;
+        uint8_t category = 0;
+        T item = T();
+    };
+
+    void record(Change&& change)
+    {
+        apply(1 - m_Front.load(), change);
+        m_Changes.push_back(std::move(change));
+    }
+
+    void apply(size_t side, const Change& change)
+    {
+        Tree& tree = m_Trees[side];
+        auto moved = [&](Entry& entry, const ItemLocation& location) { m_Locations[entry.handle][side] = location; };
+
+        ItemLocation& location = m_Locations[change.handle][side];
+
+        switch (change.type)
+        {
+        case Change::Insert: location = tree.insert({ change.handle, change.item }, change.area, change.category, moved); break;
+        case Change::Relocate: location = tree.relocate(location, change.area, moved); break;
+        case Change::Remove: tree.erase(location, moved); break;
+        }
+    }
+
+private:
+    std::array<Tree, 2> m_Trees;
+
+    // Index of the tree that the readers use, only the writer changes it
+    std::atomic<size_t> m_Front = 0;
+
+    // Readers of each tree, on separate cache lines so the readers of one don't slow down the other
+    struct alignas(64) Readers
+    {
+        std::atomic<size_t> count = 0;
+    };
+
+    mutable std::array<Readers, 2> m_Readers;
+
+    // Location of every item in each tree, indexed by the handles
+    std::vector<std::array<ItemLocation, 2>> m_Locations;
+    std::vector<Handle> m_FreeHandles;
+
+    // Changes made to the back tree since the last publish() that the other tree doesn't have yet
+    std::vector<Change> m_Changes;
+};
+
+// Quad tree without nodes. Every item is keyed by the Morton code of the quad it would be stored in
+// and its level, and the items are kept sorted by the keys in flat arrays. The items of a quad's subtree
+// are then one contiguous range that the queries find with binary searches. Inserting and removing
+// moves the items after the slot so it suits mostly static worlds that are built once
+template <class T, bool Loose = false>
+class LinearQuadTree
+{
+public:
+    // Levels below the root, the path takes 2 bits per level from the top of the key and the level the lowest 6 bits
+    static constexpr uint32_t MAX_DEPTH = 29;
+
+    LinearQuadTree(const def::rectf& area = { {0.0f, 0.0f}, {128.0f, 128.0f} })
+    {
+        create(area);
+    }
+
+    void create(const def::rectf& area)
+    {
+        m_Area = area;
+        clear();
+    }
+
+    // The size of a loose quad relative to its normal size, clears the tree
+    void set_looseness(float looseness)
+    {
+        m_Looseness = looseness;
+        clear();
+    }
+
+    void clear()
+    {
+        m_Keys.clear();
+        m_Data.clear();
+        m_X.clear();
+        m_Y.clear();
+        m_W.clear();
+        m_H.clear();
+    }
+
+    size_t size() const
+    {
+        return m_Keys.size();
+    }
+
+    // Sorts the whole batch once instead of inserting the items one by one
+    void build(const std::vector<std::pair<T, def::rectf>>& items)
+    {
+        std::vector<std::pair<uint64_t, size_t>> order(items.size());
+
+        for (size_t i = 0; i < items.size(); i++)
+            order[i] = { make_key(items[i].second), i };
+
+        std::sort(order.begin(), order.end());
+
+        clear();
+        reserve(items.size());
+
+        for (const auto& [key, index] : order)
+            push_back(key, items[index].first, items[index].second);
+    }
+
+    void insert(const T& item, const def::rectf& area)
+    {
+        uint64_t key = make_key(area);
+        size_t slot = std::upper_bound(m_Keys.begin(), m_Keys.end(), key) - m_Keys.begin();
+
+        m_Keys.insert(m_Keys.begin() + slot, key);
+        m_Data.insert(m_Data.begin() + slot, item);
+        m_X.insert(m_X.begin() + slot, area.pos.x);
+        m_Y.insert(m_Y.begin() + slot, area.pos.y);
+        m_W.insert(m_W.begin() + slot, area.size.x);
+        m_H.insert(m_H.begin() + slot, area.size.y);
+    }
+
+    // The area must be the one the item was inserted with, it leads to the run of the item's quad
+    bool remove(const T& item, const def::rectf& area)
+    {
+        auto [first, last] = std::equal_range(m_Keys.begin(), m_Keys.end(), make_key(area));
+
+        for (size_t slot = first - m_Keys.begin(); slot < size_t(last - m_Keys.begin()); slot++)
+        {
+            if (m_Data[slot] == item)
+            {
+                m_Keys.erase(m_Keys.begin() + slot);
+                m_Data.erase(m_Data.begin() + slot);
+                m_X.erase(m_X.begin() + slot);
+                m_Y.erase(m_Y.begin() + slot);
+                m_W.erase(m_W.begin() + slot);
+                m_H.erase(m_H.begin() + slot);
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    template <class Func>
+    void find(const def::rectf& area, Func&& func) const
+    {
+        find(0, 0, m_Area, 0, size(), area, func);
+    }
+
+    void find(const def::rectf& area, std::list<T>& data) const
+    {
+        find(area, [&](const T& item) { data.push_back(item); });
+    }
+
+    void find(const def::rectf& area, std::vector<T>& data) const
+    {
+        find(area, [&](const T& item) { data.push_back(item); });
+    }
+
+    size_t memory_usage() const
+    {
+        return sizeof(*this) + m_Keys.capacity() * sizeof(uint64_t) + m_Data.capacity() * sizeof(T) +
+            (m_X.capacity() + m_Y.capacity() + m_W.capacity() + m_H.capacity()) * sizeof(float);
+    }
+
+private:
+    void reserve(size_t count)
+    {
+        m_Keys.reserve(count);
+        m_Data.reserve(count);
+        m_X.reserve(count);
+        m_Y.reserve(count);
+        m_W.reserve(count);
+        m_H.reserve(count);
+    }
+
+    void push_back(uint64_t key, const T& item, const def::rectf& area)
+    {
+        m_Keys.push_back(key);
+        m_Data.push_back(item);
+        m_X.push_back(area.pos.x);
+        m_Y.push_back(area.pos.y);
+        m_W.push_back(area.size.x);
+        m_H.push_back(area.size.y);
+    }
+
+    static std::array<def::rectf, 4> split(const def::rectf& area)
+    {
+        def::vf2d childSize = area.size * 0.5f;
+
+        return
+        {
+            def::rectf(area.pos, childSize),
+            def::rectf({ area.pos.x + childSize.x, area.pos.y }, childSize),
+            def::rectf({ area.pos.x, area.pos.y + childSize.y }, childSize),
+            def::rectf(area.pos + childSize, childSize)
+        };
+    }
+
+    // Area that can hold the items of a quad, the same as in QuadTree
+    def::rectf bounds(const def::rectf& area) const
+    {
+        if constexpr (Loose)
+        {
+            def::vf2d margin = area.size * ((m_Looseness - 1.0f) * 0.5f);
+            return def::rectf(area.pos - margin, area.size + margin * 2.0f);
+        }
+        else
+            return area;
+    }
+
+    // Goes down the same way as QuadTree::insert() does
+    uint64_t make_key(const def::rectf& area) const
+    {
+        uint64_t path = 0;
+        uint32_t depth = 0;
+
+        def::rectf nodeArea = m_Area;
+
+        while (depth < MAX_DEPTH)
+        {
+            def::vf2d childSize = nodeArea.size * 0.5f;
+            def::vf2d center = nodeArea.pos + childSize;
+
+            def::vf2d point = Loose ? area.pos + area.size * 0.5f : area.pos;
+            def::rectf childArea(nodeArea.pos, childSize);
+
+            uint64_t i = 0;
+
+            if (point.x >= center.x)
+            {
+                childArea.pos.x = center.x;
+                i |= 1;
+            }
+
+            if (point.y >= center.y)
+            {
+                childArea.pos.y = center.y;
+                i |= 2;
+            }
+
+            if (!def::contains(bounds(childArea), area))
+                break;
+
+            path |= i << (62 - 2 * depth);
+            nodeArea = childArea;
+            depth++;
+        }
+
+        return path | depth;
+    }
+
+    // Items from first to last are the subtree of the quad at the path and depth
+    template <class Func>
+    void find(uint64_t path, uint32_t depth, const def::rectf& nodeArea,
+        size_t first, size_t last, const def::rectf& area, Func& func) const
+    {
+        // The items of the quad itself come first, the short runs are quicker to scan than to search
+        size_t run = first;
+
+        while (run < last && run < first + 16 && m_Keys[run] == (path | depth))
+            run++;
+
+        if (run == first + 16)
+            run = std::upper_bound(m_Keys.begin() + run, m_Keys.begin() + last, path | depth) - m_Keys.begin();
+
+#ifdef QUADTREES_QUERY_STATS
+        size_t found = 0;
+        auto counted = [&](const T& item) { found++; func(item); };
+
+        find_overlapping(m_X.data() + first, m_Y.data() + first, m_W.data() + first, m_H.data() + first,
+            m_Data.data() + first, run - first, area, counted);
+
+        count_query(1, run - first, found);
+#else
+        find_overlapping(m_X.data() + first, m_Y.data() + first, m_W.data() + first, m_H.data() + first,
+            m_Data.data() + first, run - first, area, func);
+#endif
+
+        if (run == last)
+            return;
+
+        const uint32_t shift = 62 - 2 * depth;
+        std::array<def::rectf, 4> childrenAreas = split(nodeArea);
+
+        // The subtree of child i starts at the first key with i in its bits of the level,
+        // the ranges are only searched for the children that the area reaches
+        auto start_of = [&](uint64_t i)
+            {
+                if (i == 4)
+                    return last;
+
+                return size_t(std::lower_bound(m_Keys.begin() + run, m_Keys.begin() + last, path | i << shift) - m_Keys.begin());
+            };
+
+        for (uint64_t i = 0; i < 4; i++)
+        {
+            def::rectf childBounds = bounds(childrenAreas[i]);
+
+            if (!overlaps(area, childBounds))
+                continue;
+
+            size_t begin = start_of(i);
+            size_t end = start_of(i + 1);
+
+            if (begin == end)
+                continue;
+
+            if (def::contains(area, childBounds))
+            {
+                count_query(0, 0, end - begin);
+
+                for (size_t slot = begin; slot < end; slot++)
+                    func(m_Data[slot]);
+            }
+            else
+                find(path | i << shift, depth + 1, childrenAreas[i], begin, end, area, func);
+        }
+    }
+
+private:
+    def::rectf m_Area;
+
+    float m_Looseness = 2.0f;
+
+    // Sorted keys and the items in the same order
+    std::vector<uint64_t> m_Keys;
+    std::vector<T> m_Data;
+    std::vector<float> m_X, m_Y, m_W, m_H;
+};
+
+// Read-only tree over a file written by QuadTree::save(). Opening it doesn't parse or
+// allocate anything, the file is mapped into memory and the queries run directly on it
+template <class T>
+class MappedQuadTree
+{
+public:
+    using Node = QuadTreeSnapshotNode;
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    MappedQuadTree() = default;
+
+    MappedQuadTree(const std::string& path)
+    {
+        open(path);
+    }
+
+    MappedQuadTree(const MappedQuadTree&) = delete;
+    MappedQuadTree& operator=(const MappedQuadTree&) = delete;
+
+    ~MappedQuadTree()
+    {
+        close();
+    }
+
+    // Returns false if the file can't be mapped or wasn't saved with items of type T
+    bool open(const std::string& path)
+    {
+        close();
+
+#if defined(_WIN32)
+        m_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+        if (m_File == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER fileSize;
+
+        if (!GetFileSizeEx(m_File, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(QuadTreeSnapshotHeader))
+        {
+            close();
+            return false;
+        }
+
+        m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+        if (!m_Mapping)
+        {
+            close();
+            return false;
+        }
+
+        m_Memory = (const char*)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+        m_Size = (size_t)fileSize.QuadPart;
+#else
+        int file = ::open(path.c_str(), O_RDONLY);
+
+        if (file < 0)
+            return false;
+
+        struct stat info;
+
+        if (fstat(file, &info) != 0 || info.st_size < (off_t)sizeof(QuadTreeSnapshotHeader))
+        {
+            ::close(file);
+            return false;
+        }
+
+        void* memory = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+        // The mapping stays valid after the file is closed
+        ::close(file);
+
+        if (memory == MAP_FAILED)
+            return false;
+
+        m_Memory = (const char*)memory;
+        m_Size = (size_t)info.st_size;
+#endif
+
+        if (!m_Memory || !validate())
+        {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+#if defined(_WIN32)
+        if (m_Memory)
+            UnmapViewOfFile(m_Memory);
+
+        if (m_Mapping)
+            CloseHandle(m_Mapping);
+
+        if (m_File != INVALID_HANDLE_VALUE)
+            CloseHandle(m_File);
+
+        m_Mapping = nullptr;
+        m_File = INVALID_HANDLE_VALUE;
+#else
+        if (m_Memory)
+            munmap((void*)m_Memory, m_Size);
+#endif
+
+        m_Memory = nullptr;
+        m_Size = 0;
+        m_Header = nullptr;
+    }
+
+    bool is_open() const
+    {
+        return m_Header;
+    }
+
+    size_t size() const
+    {
+        return m_Header ? m_Header->itemsCount : 0;
+    }
+
+    template <class Func>
+    void find(const def::rectf& area, Func&& func) const
+    {
+        if (m_Header)
+            find(0, area, func);
+    }
+
+    void find(const def::rectf& area, std::vector<T>& data) const
+    {
+        find(area, [&](const T& item) { data.push_back(item); });
+    }
+
+    // Size of the mapped file, the pages are only loaded when they are touched
+    size_t memory_usage() const
+    {
+        return m_Size;
+    }
+
+private:
+    bool validate()
+    {
+        const auto* header = (const QuadTreeSnapshotHeader*)m_Memory;
+
+        if (std::memcmp(header->magic, QUADTREE_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != QUADTREE_SNAPSHOT_VERSION || header->itemSize != sizeof(T) ||
+            header->nodesCount == 0 || header->fileSize > m_Size)
+            return false;
+
+        // Every sum and product is checked against the file size first so none of them can wrap
+        const uint64_t fileSize = header->fileSize;
+
+        if (header->nodesCount > fileSize / sizeof(Node) || header->itemsCount > fileSize / sizeof(T) ||
+            header->itemsCount > fileSize / sizeof(float))
+            return false;
+
+        auto fits = [&](uint64_t offset, uint64_t bytes)
+            {
+                return offset % QUADTREE_SNAPSHOT_ALIGNMENT == 0 && offset <= fileSize && bytes <= fileSize - offset;
+            };
+
+        uint64_t floatsSize = header->itemsCount * sizeof(float);
+
+        if (!fits(header->nodesOffset, header->nodesCount * sizeof(Node)) ||
+            !fits(header->xOffset, floatsSize) || !fits(header->yOffset, floatsSize) ||
+            !fits(header->wOffset, floatsSize) || !fits(header->hOffset, floatsSize) ||
+            !fits(header->dataOffset, header->itemsCount * sizeof(T)))
+            return false;
+
+        // The queries follow the children and read the item ranges without any checks.
+        // The nodes are depth-first so a child always comes after its parent, which also rules out cycles
+        const Node* nodes = (const Node*)(m_Memory + header->nodesOffset);
+
+        for (uint32_t n = 0; n < header->nodesCount; n++)
+        {
+            const Node& node = nodes[n];
+
+            if (uint64_t(node.firstItem) + node.itemsCount > header->itemsCount ||
+                uint64_t(node.firstItem) + node.count > header->itemsCount || node.itemsCount > node.count)
+                return false;
+
+            for (uint32_t child : node.children)
+            {
+                if (child != NONE && (child <= n || child >= header->nodesCount))
+                    return false;
+            }
+        }
+
+        m_Header = header;
+        m_Nodes = nodes;
+        m_X = (const float*)(m_Memory + header->xOffset);
+        m_Y = (const float*)(m_Memory + header->yOffset);
+        m_W = (const float*)(m_Memory + header->wOffset);
+        m_H = (const float*)(m_Memory + header->hOffset);
+        m_Data = (const T*)(m_Memory + header->dataOffset);
+
+        return true;
+    }
+
+    static def::rectf child_area(const Node& node, size_t i)
+    {
+        const float* area = node.childrenAreas[i];
+        return def::rectf({ area[0], area[1] }, { area[2], area[3] });
+    }
+
+    template <class Func>
+    void find(uint32_t index, const def::rectf& area, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+        size_t first = node.firstItem;
+
+#ifdef QUADTREES_QUERY_STATS
+        size_t found = 0;
+        auto counted = [&](const T& item) { found++; func(item); };
+
+        find_overlapping(m_X + first, m_Y + first, m_W + first, m_H + first,
+            m_Data + first, node.itemsCount, area, counted);
+
+        count_query(1, node.itemsCount, found);
+#else
+        find_overlapping(m_X + first, m_Y + first, m_W + first, m_H + first,
+            m_Data + first, node.itemsCount, area, func);
+#endif
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            if (node.children[i] != NONE)
+            {
+                def::rectf childArea = child_area(node, i);
+
+                if (def::contains(area, childArea))
+                    collect_items(node.children[i], func);
+
+                else if (overlaps(area, childArea))
+                    find(node.children[i], area, func);
+            }
+        }
+    }
+
+    // The items of a subtree are contiguous so there is no need to visit its nodes
+    template <class Func>
+    void collect_items(uint32_t index, Func& func) const
+    {
+        const Node& node = m_Nodes[index];
+        count_query(1, 0, node.count);
+
+        for (size_t i = node.firstItem; i < node.firstItem + node.count; i++)
+            func(m_Data[i]);
+    }
+
+private:
+    const char* m_Memory = nullptr;
+    size_t m_Size = 0;
+
+#if defined(_WIN32)
+    HANDLE m_File = INVALID_HANDLE_VALUE;
+    HANDLE m_Mapping = nullptr;
+#endif
+
+    const QuadTreeSnapshotHeader* m_Header = nullptr;
+    const Node* m_Nodes = nullptr;
+    const float* m_X = nullptr;
+    const float* m_Y = nullptr;
+    const float* m_W = nullptr;
+    const float* m_H = nullptr;
+    const T* m_Data = nullptr;
+
+};
+
+// Collects the sprites of a frame and hands them out grouped by layer and then by sprite,
+// so every group is drawn in one pass with the same source rectangle. The entries are
+// ordered with a counting sort and the buffers are kept between frames
+class SpriteBatch
+{
+public:
+    void begin(size_t layers, size_t sprites)
+    {
+        m_Layers = std::max<size_t>(layers, 1);
+        m_Sprites = std::max<size_t>(sprites, 1);
+        m_Entries.clear();
+    }
+
+    // Layers are drawn in order, the layer is clamped to the ones given to begin()
+    void add(size_t layer, size_t sprite, const def::Vector2f& pos)
+    {
+        m_Entries.push_back({ uint32_t(std::min(layer, m_Layers - 1) * m_Sprites + sprite), pos });
+    }
+
+    size_t size() const
+    {
+        return m_Entries.size();
+    }
+
+    // Calls draw(sprite, positions, count) once for every non-empty group
+    template <class Draw>
+    void end(Draw&& draw)
+    {
+        m_Offsets.assign(m_Layers * m_Sprites + 1, 0);
+
+        for (const auto& entry : m_Entries)
+            m_Offsets[entry.key + 1]++;
+
+        for (size_t i = 1; i < m_Offsets.size(); i++)
+            m_Offsets[i] += m_Offsets[i - 1];
+
+        m_Sorted.resize(m_Entries.size());
+
+        // Shifts the offsets so each one ends up at the start of the next group
+        for (const auto& entry : m_Entries)
+            m_Sorted[m_Offsets[entry.key]++] = entry.pos;
+
+        size_t first = 0;
+
+        for (size_t key = 0; key < m_Layers * m_Sprites; key++)
+        {
+            size_t last = m_Offsets[key];
+
+            if (last != first)
+                draw(key % m_Sprites, m_Sorted.data() + first, last - first);
+
+            first = last;
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint32_t key;
+        def::Vector2f pos;
+    };
+
+    size_t m_Layers = 1;
+    size_t m_Sprites = 1;
+
+    std::vector<Entry> m_Entries;
+    std::vector<def::Vector2f> m_Sorted;
+    std::vector<uint32_t> m_Offsets;
+
+};
+
+class App : public def::GameEngine
+{
+public:
+    App()
+    {
+        GetWindow()->SetTitle("Quad trees");
+        UseOnlyTextures(true);
+    }
+
+    enum class PlantID
+    {
+        LargeTree,
+        LargeBush,
+        SmallTree,
+        SmallBush
+    };
+
+    struct Object
+    {
+        def::rectf area;
+        PlantID id;
+    };
+
+    using ObjectTree = QuadTreeContainer<Object>;
+
+    ObjectTree tree;
+
+    def::AffineTransforms at;
+
+    float worldSize = 25000.0f;
+    float searchAreaSize = 100.0f;
+
+    def::Graphic plants;
+
+    std::vector<ObjectTree::Storage::iterator> visible;
+    QuadTreeQueryCache<ObjectTree> visibleCache;
+
+    enum class QueryMode
+    {
+        List,
+        Visitor,
+        Parallel,
+        Cached,
+        LevelOfDetail
+    };
+
+    // Press L to switch between the ways of querying the visible objects
+    QueryMode queryMode = QueryMode::List;
+
+    // Nodes smaller than that on the screen are drawn as a single tile
+    float tileSize = 8.0f;
+    size_t allocationsPerQuery = 0;
+
+    // Nodes and items that the last query went through
+    QueryStats queryWork;
+
+    // Press P to count the overlapping plants in the whole world
+    size_t overlappingPairs = 0;
+
+    // Press B to switch between drawing the plants in the order of the query and in batches
+    bool batchSprites = false;
+
+    // Press T to show only one kind of plant in the list and visitor queries, 4 shows all of them
+    size_t shownPlants = 4;
+
+    // Press D to draw the nodes on the screen coloured by the number of their own plants
+    bool drawNodes = false;
+    size_t maxNodeDepth = 16;
+    float minNodeSize = 4.0f;
+    SpriteBatch batch;
+
+    // Rows of the world that are drawn one after another so the lower plants cover the upper ones
+    const float layerHeight = 32.0f;
+
+protected:
+    bool OnUserCreate() override
+    {
+        tree.create({ {0.0f, 0.0f}, {worldSize, worldSize} });
+
+        // Counted for the tiles of the level of detail query and the plant filter
+        tree.set_categories(4);
+        at.SetViewArea(GetWindow()->GetScreenSize());
+
+        auto rand_float = [](float min, float max)
+            {
+                return min + (float)rand() / (float)RAND_MAX * (max - min);
+            };
+
+        std::vector<std::pair<Object, def::rectf>> objects;
+        objects.reserve(1000000);
+
+        for (size_t i = 0; i < 1000000; i++)
+        {
+            Object o;
+
+            o.area.pos = { rand_float(0.0f, worldSize), rand_float(0.0f, worldSize) };
+            o.id = PlantID(rand() % 4);
+
+            o.area.size.x = 16.0f;
+            
+            if (o.id == PlantID::LargeTree || o.id == PlantID::LargeBush)
+                o.area.size.y = 32.0f;
+            else
+                o.area.size.x = 16.0f;
+
+            objects.push_back({ o, o.area });
+        }
+
+        tree.build(objects, true, [](const Object& o) { return uint8_t(o.id); });
+
+        plants.Load("plants.png");
+
+        return true;
+    }
+
+    bool OnUserUpdate(float) override
+    {
+        auto i = GetInput();
+
+        if (i->GetButtonState(def::Button::WHEEL).pressed)
+            at.StartPan(GetInput()->GetMousePosition());
+
+        if (i->GetButtonState(def::Button::WHEEL).held)
+            at.UpdatePan(GetInput()->GetMousePosition());
+
+        if (i->GetScrollDelta() > 0)
+        {
+            if (i->GetKeyState(def::Key::LEFT_CONTROL).held)
+                searchAreaSize *= 0.9f;
+            else
+                at.Zoom(1.1f, i->GetMousePosition());
+        }
+
+        if (i->GetScrollDelta() < 0)
+        {
+            if (i->GetKeyState(def::Key::LEFT_CONTROL).held)
+                searchAreaSize *= 1.1f;
+            else
+                at.Zoom(0.9f, i->GetMousePosition());
+        }
+
+        def::Vector2f mouse = at.ScreenToWorld(i->GetMousePosition());
+        def::rectf selectedArea({ mouse.x - searchAreaSize * 0.5f, mouse.y - searchAreaSize * 0.5f }, { searchAreaSize, searchAreaSize });
+
+        if (i->GetButtonState(def::Button::LEFT).held)
+            tree.erase_in(selectedArea);
+
+        // Fills the holes left by the cleared nodes a bit every frame
+        tree.compact(std::chrono::microseconds(500));
+
+        if (i->GetKeyState(def::Key::L).pressed)
+            queryMode = QueryMode(((int)queryMode + 1) % 5);
+
+        if (i->GetKeyState(def::Key::B).pressed)
+            batchSprites = !batchSprites;
+
+        if (i->GetKeyState(def::Key::T).pressed)
+            shownPlants = (shownPlants + 1) % 5;
+
+        if (i->GetKeyState(def::Key::D).pressed)
+            drawNodes = !drawNodes;
+
+        if (i->GetKeyState(def::Key::P).pressed)
+        {
+            std::atomic<size_t> pairs = 0;
+
+            tree.for_each_overlapping_pair([&](auto, auto) { pairs++; }, true);
+            overlappingPairs = pairs;
+        }
+
+        def::Vector2f origin = at.GetOrigin();
+        def::Vector2f size = at.GetEnd() - origin;
+
+        def::rectf searchArea = { { origin.x, origin.y }, { size.x, size.y } };
+
+        ClearTexture(def::GREEN);
+
+        // Part of plants.png for each PlantID
+        const def::Vector2f spritePos[4] = { { 0.0f, 0.0f }, { 16.0f, 0.0f }, { 32.0f, 7.0f }, { 48.0f, 16.0f } };
+        const def::Vector2f spriteSize[4] = { { 16.0f, 32.0f }, { 16.0f, 32.0f }, { 16.0f, 25.0f }, { 16.0f, 16.0f } };
+
+        batch.begin(size_t(size.y / layerHeight) + 2, 4);
+
+        auto draw_object = [&](const Object& o)
+            {
+                def::Vector2f pos = { o.area.pos.x, o.area.pos.y };
+                size_t sprite = (size_t)o.id;
+
+                if (batchSprites)
+                {
+                    // Plants that start above the screen go to the first layer
+                    batch.add(size_t(std::max(pos.y - origin.y + layerHeight, 0.0f) / layerHeight), sprite, pos);
+                }
+                else
+                    at.DrawPartialTexture(pos, plants.texture, spritePos[sprite], spriteSize[sprite]);
+            };
+
+        size_t objectsCount = 0;
+
+#ifdef QUADTREES_COUNT_ALLOCATIONS
+        size_t allocations = g_Allocations;
+#endif
+
+        QueryStats before = query_stats();
+
+        uint64_t categories = shownPlants < 4 ? ObjectTree::Tree::category_bit(uint8_t(shownPlants)) : ObjectTree::Tree::ALL_CATEGORIES;
+
+        switch (queryMode)
+        {
+        case QueryMode::List:
+        {
+            std::list<ObjectTree::Storage::iterator> objects;
+
+            if (shownPlants < 4)
+                tree.find(searchArea, categories, [&](ObjectTree::Storage::iterator obj) { objects.push_back(obj); });
+            else
+                tree.find(searchArea, objects);
+
+            for (const auto& obj : objects)
+                draw_object(obj->data);
+
+            objectsCount = objects.size();
+        }
+        break;
+
+        case QueryMode::Visitor:
+        {
+            tree.find(searchArea, categories, [&](ObjectTree::Storage::iterator obj)
+                {
+                    draw_object(obj->data);
+                    objectsCount++;
+                });
+        }
+        break;
+
+        case QueryMode::Parallel:
+        {
+            // Only the query runs on many threads, drawing stays here
+            visible.clear();
+            tree.find_parallel(searchArea, visible);
+
+            for (const auto& obj : visible)
+                draw_object(obj->data);
+
+            objectsCount = visible.size();
+        }
+        break;
+
+        case QueryMode::Cached:
+        {
+            // Only the strips that appeared since the last frame are queried
+            for (const auto& obj : visibleCache.update(tree, searchArea))
+                draw_object(obj->data);
+
+            objectsCount = visibleCache.items().size();
+        }
+        break;
+
+        case QueryMode::LevelOfDetail:
+        {
+            // Colour of each plant and how much of the ground it covers on average
+            const float colours[4][3] = { { 20, 90, 20 }, { 60, 140, 40 }, { 40, 120, 60 }, { 110, 170, 60 } };
+            const float plantArea = 16.0f * 24.0f;
+
+            float worldPerPixel = size.x / (float)GetWindow()->GetScreenSize().x;
+
+            auto draw_tile = [&](const def::rectf& area, size_t count, const uint32_t* categories)
+                {
+                    float rgb[3] = {};
+
+                    for (size_t c = 0; c < 4; c++)
+                    {
+                        for (size_t k = 0; k < 3; k++)
+                            rgb[k] += colours[c][k] * categories[c] / count;
+                    }
+
+                    float coverage = std::min(count * plantArea / (area.size.x * area.size.y), 1.0f);
+
+                    at.FillTextureRectangle({ area.pos.x, area.pos.y }, { area.size.x, area.size.y },
+                        def::Pixel(uint8_t(rgb[0]), uint8_t(rgb[1]), uint8_t(rgb[2]), uint8_t(coverage * 255.0f)));
+
+                    objectsCount += count;
+                };
+
+            tree.find_lod(searchArea, tileSize * worldPerPixel, [&](ObjectTree::Storage::iterator obj)
+                {
+                    draw_object(obj->data);
+                    objectsCount++;
+                }, draw_tile);
+        }
+        break;
+
+        }
+
+#ifdef QUADTREES_COUNT_ALLOCATIONS
+        allocationsPerQuery = g_Allocations - allocations;
+#endif
+
+        queryWork = query_stats() - before;
+
+        batch.end([&](size_t sprite, const def::Vector2f* positions, size_t count)
+            {
+                const def::Vector2f& filePos = spritePos[sprite];
+                const def::Vector2f& fileSize = spriteSize[sprite];
+
+                for (size_t n = 0; n < count; n++)
+                    at.DrawPartialTexture(positions[n], plants.texture, filePos, fileSize);
+            });
+
+        if (drawNodes)
+        {
+            float worldPerPixel = size.x / (float)GetWindow()->GetScreenSize().x;
+
+            // Green nodes are empty, red ones keep 32 plants or more
+            tree.find_nodes(searchArea, maxNodeDepth, minNodeSize * worldPerPixel,
+                [&](const def::rectf& area, size_t, size_t items, size_t count)
+                {
+                    if (count == 0)
+                        return;
+
+                    uint8_t load = uint8_t(std::min(items * 8, size_t(255)));
+
+                    at.DrawTextureRectangle({ area.pos.x, area.pos.y }, { area.size.x, area.size.y },
+                        def::Pixel(load, 255 - load, 0));
+                });
+        }
+
+        DrawTextureString({ 0, 0 }, std::to_string(objectsCount));
+        const char* queryModes[] = { "std::list query (L)", "visitor query (L)", "parallel query (L)", "cached query (L)", "level of detail query (L)" };
+        DrawTextureString({ 0, 10 }, queryModes[(int)queryMode]);
+        DrawTextureString({ 0, 30 }, "overlapping pairs (P): " + std::to_string(overlappingPairs));
+        DrawTextureString({ 0, 40 }, batchSprites ? "batched sprites (B)" : "sprites in query order (B)");
+
+        const char* plantNames[] = { "large trees (T)", "large bushes (T)", "small trees (T)", "small bushes (T)", "all plants (T)" };
+        DrawTextureString({ 0, 60 }, plantNames[shownPlants]);
+        DrawTextureString({ 0, 70 }, drawNodes ? "nodes shown (D)" : "nodes hidden (D)");
+
+#ifdef QUADTREES_COUNT_ALLOCATIONS
+        DrawTextureString({ 0, 20 }, "allocations per query: " + std::to_string(allocationsPerQuery));
+#endif
+
+#ifdef QUADTREES_QUERY_STATS
+        DrawTextureString({ 0, 50 }, "nodes visited: " + std::to_string(queryWork.nodesVisited) +
+            ", items tested: " + std::to_string(queryWork.itemsTested) + ", returned: " + std::to_string(queryWork.itemsReturned));
+#endif
+
+        at.FillTextureRectangle(
+            { selectedArea.pos.x, selectedArea.pos.y },
+            { selectedArea.size.x, selectedArea.size.y },
+            def::Pixel(255, 255, 255, 100));
+
+        // Highlight the plant that is the closest to the mouse
+        ObjectTree::Storage::iterator closest;
+
+        if (tree.nearest({ mouse.x, mouse.y }, closest, searchAreaSize))
+        {
+            at.FillTextureRectangle(
+                { closest->data.area.pos.x, closest->data.area.pos.y },
+                { closest->data.area.size.x, closest->data.area.size.y },
+                def::Pixel(255, 0, 0, 100));
+        }
+
+        return true;
+    }
+};
+
+#ifdef QUADTREES_BENCHMARK
+
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+
+// Headless benchmarks of the trees, build with QUADTREES_BENCHMARK defined.
+// Pass the item counts as arguments to run only some of the sizes and
+// "loose" to run the comparison between the tight and the loose tree, "compact" for the compact areas.
+// "check" runs the consistency checks instead and fails the process when one of them does
+namespace Benchmark
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Plant
+    {
+        def::rectf area;
+        int id;
+
+        bool operator==(const Plant& plant) const
+        {
+            return id == plant.id && area.pos == plant.area.pos && area.size == plant.area.size;
+        }
+    };
+
+    using Plants = std::vector<std::pair<Plant, def::rectf>>;
+
+    // Keep the density of the plants from App for every count
+    constexpr float WORLD_SIZE_PER_MILLION = 25000.0f;
+    constexpr float MAX_PLANT_SIZE = 32.0f;
+
+    double elapsed_ms(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    float world_size(size_t count)
+    {
+        return WORLD_SIZE_PER_MILLION * std::sqrt((float)count / 1000000.0f);
+    }
+
+    // The same scene as in App::OnUserCreate
+    Plants make_plants(size_t count, float worldSize, std::mt19937& rng)
+    {
+        std::uniform_real_distribution<float> position(0.0f, worldSize);
+        std::uniform_int_distribution<int> id(0, 3);
+
+        Plants plants(count);
+
+        for (auto& [plant, area] : plants)
+        {
+            plant.id = id(rng);
+            plant.area.pos = { position(rng), position(rng) };
+            plant.area.size = { 16.0f, plant.id < 2 ? 32.0f : 16.0f };
+            area = plant.area;
+        }
+
+        return plants;
+    }
+
+    std::vector<def::rectf> make_queries(size_t count, float size, float worldSize, std::mt19937& rng)
+    {
+        std::uniform_real_distribution<float> position(0.0f, std::max(worldSize - size, 0.0f));
+
+        std::vector<def::rectf> queries(count);
+
+        for (auto& query : queries)
+            query = def::rectf({ position(rng), position(rng) }, { size, size });
+
+        return queries;
+    }
+
+    // Every plant is stored in the cell of its top-left corner
+    // so the queries are extended by the size of the biggest plant
+    class UniformGrid
+    {
+    public:
+        UniformGrid(float worldSize, float cellSize)
+            : m_CellSize(cellSize)
+        {
+            m_Cells = std::max<size_t>(size_t(worldSize / cellSize) + 1, 1);
+            m_Grid.resize(m_Cells * m_Cells);
+        }
+
+        void insert(const Plant* plant)
+        {
+            m_Grid[cell_of(plant->area.pos.x) + cell_of(plant->area.pos.y) * m_Cells].push_back(plant);
+        }
+
+        void remove(const Plant* plant)
+        {
+            auto& cell = m_Grid[cell_of(plant->area.pos.x) + cell_of(plant->area.pos.y) * m_Cells];
+            auto it = std::find(cell.begin(), cell.end(), plant);
+
+            *it = cell.back();
+            cell.pop_back();
+        }
+
+        template <class Func>
+        void find(const def::rectf& area, Func&& func) const
+        {
+            size_t x1 = cell_of(area.pos.x - MAX_PLANT_SIZE), x2 = cell_of(area.pos.x + area.size.x);
+            size_t y1 = cell_of(area.pos.y - MAX_PLANT_SIZE), y2 = cell_of(area.pos.y + area.size.y);
+
+            for (size_t y = y1; y <= y2; y++)
+            {
+                for (size_t x = x1; x <= x2; x++)
+                {
+                    for (const Plant* plant : m_Grid[x + y * m_Cells])
+                    {
+                        if (overlaps(area, plant->area))
+                            func(plant);
+                    }
+                }
+            }
+        }
+
+        // Only the cells, the plants themselves are stored outside of the grid
+        size_t memory_usage() const
+        {
+            size_t bytes = sizeof(*this) + m_Grid.capacity() * sizeof(m_Grid[0]);
+
+            for (const auto& cell : m_Grid)
+                bytes += cell.capacity() * sizeof(const Plant*);
+
+            return bytes;
+        }
+
+    private:
+        size_t cell_of(float coord) const
+        {
+            return (size_t)std::clamp(coord / m_CellSize, 0.0f, float(m_Cells - 1));
+        }
+
+    private:
+        float m_CellSize;
+        size_t m_Cells;
+
+        std::vector<std::vector<const Plant*>> m_Grid;
+    };
+
+    void print_row(const char* name, size_t count, const char* operation, double ms, size_t operations, size_t found = 0)
+    {
+        printf("%10zu  %-12s %-16s %12.3f ms %12.3f us/op", count, name, operation, ms, ms * 1000.0 / std::max<size_t>(operations, 1));
+
+        if (found > 0)
+            printf(" %10.1f found/op", (double)found / operations);
+
+        printf("\n");
+    }
+
+    void print_memory(const char* name, size_t count, size_t bytes)
+    {
+        printf("%10zu  %-12s %-16s %12.1f MB %12.1f B/item\n", count, name, "memory",
+            bytes / (1024.0 * 1024.0), (double)bytes / count);
+    }
+
+    template <class Stats>
+    void print_stats(const char* name, const Stats& stats)
+    {
+        printf("%-6s %zu nodes   %zu leaves   depth %zu max %.1f average   %zu of %zu items in interior nodes\n",
+            name, stats.nodes, stats.leaves, stats.maxDepth, stats.averageDepth, stats.interiorItems, stats.items);
+
+        printf("%-6s items per node  0: %zu", name, stats.itemsHistogram[0]);
+
+        for (size_t i = 1; i < stats.itemsHistogram.size(); i++)
+            printf("   %zu+: %zu", size_t(1) << (i - 1), stats.itemsHistogram[i]);
+
+        printf("\n");
+    }
+
+    // Nodes and items that the queries went through since before
+    void print_query_stats(size_t count, const QueryStats& before, size_t queries)
+    {
+#ifdef QUADTREES_QUERY_STATS
+        QueryStats work = query_stats() - before;
+
+        printf("%10zu  %-12s %-16s %12.1f nodes/op %9.1f tested/op %9.1f found/op\n", count, "", "",
+            (double)work.nodesVisited / queries, (double)work.itemsTested / queries, (double)work.itemsReturned / queries);
+#else
+        (void)count; (void)before; (void)queries;
+#endif
+    }
+
+    void compare(size_t count)
+    {
+        constexpr size_t QUERIES = 50;
+        constexpr float QUERY_SIZES[] = { 64.0f, 512.0f, 4096.0f };
+
+        const float worldSize = world_size(count);
+        const def::rectf world({ 0.0f, 0.0f }, { worldSize, worldSize });
+
+        std::mt19937 rng(0);
+        Plants plants = make_plants(count, worldSize, rng);
+
+        // Every 10th plant is removed
+        const size_t removals = count / 10;
+
+        // Quad tree
+        {
+            QuadTreeContainer<Plant> tree(world);
+
+            auto start = Clock::now();
+
+            for (const auto& [plant, area] : plants)
+                tree.insert(plant, area);
+
+            print_row("quadtree", count, "insert", elapsed_ms(start), count);
+
+            start = Clock::now();
+            tree.build(plants);
+            print_row("quadtree", count, "build", elapsed_ms(start), count);
+
+            print_memory("quadtree", count, tree.memory_usage());
+
+            for (float size : QUERY_SIZES)
+            {
+                auto queries = make_queries(QUERIES, size, worldSize, rng);
+                size_t found = 0;
+
+                QueryStats before = query_stats();
+                start = Clock::now();
+
+                for (const auto& query : queries)
+                    tree.find(query, [&](auto) { found++; });
+
+                std::string name = "query " + std::to_string((int)size);
+                print_row("quadtree", count, name.c_str(), elapsed_ms(start), QUERIES, found);
+                print_query_stats(count, before, QUERIES);
+            }
+
+            // Debug overlay of a 4096 wide screen that draws nothing smaller than 4 pixels at 1024 pixels wide
+            {
+                std::list<def::rectf> areas;
+
+                start = Clock::now();
+                tree.collect_areas(areas);
+                print_row("quadtree", count, "collect areas", elapsed_ms(start), 1, areas.size());
+
+                auto screens = make_queries(QUERIES, 4096.0f, worldSize, rng);
+                size_t found = 0;
+
+                start = Clock::now();
+
+                for (const auto& screen : screens)
+                    tree.find_nodes(screen, 16, 16.0f, [&](const def::rectf&, size_t, size_t, size_t) { found++; });
+
+                print_row("quadtree", count, "find nodes", elapsed_ms(start), QUERIES, found);
+            }
+
+            // Queries for a kind of plant that is one in 64, filtered after the query and by the masks of the nodes
+            {
+                using Typed = QuadTreeContainer<Plant>;
+
+                Plants typed = plants;
+
+                for (size_t i = 0; i < typed.size(); i += 64)
+                    typed[i].first.id += 4;
+
+                Typed rare(world);
+                rare.build(typed, false, [](const Plant& plant) { return uint8_t(plant.id >= 4); });
+
+                auto queries = make_queries(QUERIES, 4096.0f, worldSize, rng);
+                size_t found = 0;
+
+                QueryStats before = query_stats();
+                start = Clock::now();
+
+                for (const auto& query : queries)
+                    rare.find(query, [&](Typed::Storage::iterator item) { found += item->data.id >= 4; });
+
+                print_row("quadtree", count, "rare kind filter", elapsed_ms(start), QUERIES, found);
+                print_query_stats(count, before, QUERIES);
+
+                found = 0;
+                before = query_stats();
+                start = Clock::now();
+
+                for (const auto& query : queries)
+                    rare.find(query, Typed::Tree::category_bit(1), [&](auto) { found++; });
+
+                print_row("quadtree", count, "rare kind mask", elapsed_ms(start), QUERIES, found);
+                print_query_stats(count, before, QUERIES);
+            }
+
+            // Line of sight over the length of the screen, the old way was to query the bounding box of the segment
+            {
+                constexpr float LENGTH = 512.0f;
+
+                std::uniform_real_distribution<float> position(0.0f, worldSize);
+                std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+
+                std::vector<std::pair<def::vf2d, def::vf2d>> segments(QUERIES * 20);
+
+                for (auto& [origin, direction] : segments)
+                {
+                    float a = angle(rng);
+                    origin = { position(rng), position(rng) };
+                    direction = { std::cos(a), std::sin(a) };
+                }
+
+                size_t found = 0;
+                start = Clock::now();
+
+                for (const auto& [origin, direction] : segments)
+                {
+                    def::vf2d end = origin + direction * LENGTH;
+                    def::vf2d low(std::min(origin.x, end.x), std::min(origin.y, end.y));
+                    def::vf2d high(std::max(origin.x, end.x), std::max(origin.y, end.y));
+
+                    tree.find(def::rectf(low, high - low), [&](auto) { found++; });
+                }
+
+                print_row("quadtree", count, "segment box", elapsed_ms(start), segments.size(), found);
+
+                QuadTreeContainer<Plant>::Storage::iterator item;
+                float distance;
+
+                found = 0;
+                start = Clock::now();
+
+                for (const auto& [origin, direction] : segments)
+                    found += tree.raycast(origin, direction, LENGTH, item, distance);
+
+                print_row("quadtree", count, "raycast first", elapsed_ms(start), segments.size(), found);
+
+                std::vector<std::pair<QuadTreeContainer<Plant>::Storage::iterator, float>> hits;
+
+                found = 0;
+                start = Clock::now();
+
+                for (const auto& [origin, direction] : segments)
+                {
+                    tree.raycast(origin, direction, LENGTH, hits);
+                    found += hits.size();
+                }
+
+                print_row("quadtree", count, "raycast all", elapsed_ms(start), segments.size(), found);
+            }
+
+            // Snapshot of the built tree mapped back from a file
+            {
+                const char* path = "quadtree_benchmark.qtree";
+
+                start = Clock::now();
+                bool saved = tree.save(path);
+                print_row("snapshot", count, "save", elapsed_ms(start), count);
+
+                MappedQuadTree<Plant> mapped;
+
+                start = Clock::now();
+                bool opened = saved && mapped.open(path);
+                print_row("snapshot", count, "open", elapsed_ms(start), 1);
+
+                if (opened)
+                {
+                    for (float size : QUERY_SIZES)
+                    {
+                        auto queries = make_queries(QUERIES, size, worldSize, rng);
+                        size_t found = 0;
+
+                        start = Clock::now();
+
+                        for (const auto& query : queries)
+                            mapped.find(query, [&](const Plant&) { found++; });
+
+                        std::string name = "query " + std::to_string((int)size);
+                        print_row("snapshot", count, name.c_str(), elapsed_ms(start), QUERIES, found);
+                    }
+                }
+
+                mapped.close();
+                std::remove(path);
+            }
+
+            std::vector<QuadTreeContainer<Plant>::Storage::iterator> handles;
+            tree.find(world, handles);
+
+            // A frame of gameplay that moves every 10th plant in no particular order,
+            // once applied right away and once recorded and committed at the end
+            {
+                std::vector<QuadTreeContainer<Plant>::Storage::iterator> moving;
+
+                for (size_t i = 0; i < handles.size(); i += 10)
+                    moving.push_back(handles[i]);
+
+                std::shuffle(moving.begin(), moving.end(), rng);
+
+                auto moved = [&](QuadTreeContainer<Plant>::Storage::iterator item, float step)
+                    {
+                        def::rectf area = tree.item_area(item);
+                        area.pos.x = std::clamp(area.pos.x + step, 0.0f, worldSize - area.size.x);
+
+                        return area;
+                    };
+
+                start = Clock::now();
+
+                for (auto& item : moving)
+                    tree.relocate(item, moved(item, 8.0f));
+
+                print_row("quadtree", count, "frame immediate", elapsed_ms(start), moving.size());
+
+                start = Clock::now();
+
+                for (auto& item : moving)
+                    tree.defer_relocate(item, moved(item, -8.0f));
+
+                tree.commit();
+
+                print_row("quadtree", count, "frame commit", elapsed_ms(start), moving.size());
+
+                // New plants spread over the world, taken out again after each run
+                Plants spawned = make_plants(count / 10, worldSize, rng);
+
+                auto despawn = [&]()
+                    {
+                        std::vector<QuadTreeContainer<Plant>::Storage::iterator> all;
+                        tree.find(world, all);
+
+                        for (auto& item : all)
+                        {
+                            if (item->data.id < 0)
+                                tree.remove(item);
+                        }
+                    };
+
+                for (auto& [plant, area] : spawned)
+                    plant.id = -1;
+
+                start = Clock::now();
+
+                for (const auto& [plant, area] : spawned)
+                    tree.insert(plant, area);
+
+                print_row("quadtree", count, "spawn immediate", elapsed_ms(start), spawned.size());
+                despawn();
+
+                start = Clock::now();
+
+                for (const auto& [plant, area] : spawned)
+                    tree.defer_insert(plant, area);
+
+                tree.commit();
+
+                print_row("quadtree", count, "spawn commit", elapsed_ms(start), spawned.size());
+                despawn();
+            }
+
+            start = Clock::now();
+
+            for (size_t i = 0; i < handles.size(); i += 10)
+                tree.remove(handles[i]);
+
+            print_row("quadtree", count, "remove", elapsed_ms(start), removals);
+
+            // Area of effect destruction, once by querying and removing each hit and once in bulk
+            {
+                auto blasts = make_queries(QUERIES, 1024.0f, worldSize, rng);
+                std::vector<QuadTreeContainer<Plant>::Storage::iterator> hits;
+
+                tree.build(plants);
+
+                size_t found = 0;
+                start = Clock::now();
+
+                for (const auto& blast : blasts)
+                {
+                    hits.clear();
+                    tree.find(blast, hits);
+
+                    for (auto& hit : hits)
+                        tree.remove(hit);
+
+                    found += hits.size();
+                }
+
+                print_row("quadtree", count, "blast remove", elapsed_ms(start), QUERIES, found);
+
+                tree.build(plants);
+
+                found = 0;
+                start = Clock::now();
+
+                for (const auto& blast : blasts)
+                    found += tree.erase_in(blast);
+
+                print_row("quadtree", count, "blast erase_in", elapsed_ms(start), QUERIES, found);
+
+                // Fill the holes left by the cleared nodes
+                start = Clock::now();
+                tree.compact();
+                print_row("quadtree", count, "compact", elapsed_ms(start), 1);
+            }
+        }
+
+        // Morton keyed arrays, every insert and remove moves the items after the slot
+        // so only a few are removed
+        {
+            LinearQuadTree<Plant> tree(world);
+
+            auto start = Clock::now();
+            tree.build(plants);
+            print_row("morton", count, "build", elapsed_ms(start), count);
+
+            print_memory("morton", count, tree.memory_usage());
+
+            for (float size : QUERY_SIZES)
+            {
+                auto queries = make_queries(QUERIES, size, worldSize, rng);
+                size_t found = 0;
+
+                QueryStats before = query_stats();
+                start = Clock::now();
+
+                for (const auto& query : queries)
+                    tree.find(query, [&](auto) { found++; });
+
+                std::string name = "query " + std::to_string((int)size);
+                print_row("morton", count, name.c_str(), elapsed_ms(start), QUERIES, found);
+                print_query_stats(count, before, QUERIES);
+            }
+
+            const size_t few = std::min<size_t>(removals, 1000);
+            start = Clock::now();
+
+            for (size_t i = 0; i < few * 10; i += 10)
+                tree.remove(plants[i].first, plants[i].second);
+
+            print_row("morton", count, "remove", elapsed_ms(start), few);
+        }
+
+        // Uniform grid with cells of the size of the screen at zoom 1
+        {
+            UniformGrid grid(worldSize, 256.0f);
+
+            auto start = Clock::now();
 
-        for (auto& child : m_Children)
-        {
-            if (child)
-                count += child.size();
-        }
+            for (const auto& plant : plants)
+                grid.insert(&plant.first);
 
-        return count;
-    }
+            print_row("grid", count, "insert", elapsed_ms(start), count);
+            print_memory("grid", count, grid.memory_usage());
 
-    ItemLocation insert(const T& item, const def::rectf& area)
-    {
-        for (size_t i = 0; i < 4; i++)
-        {
-            if (def::contains(m_ChildrenAreas[i], area))
+            for (float size : QUERY_SIZES)
             {
-                if (!m_Children[i])
-                    m_Children[i] = std::make_shared<QuadTree<T>>(m_ChildrenAreas[i], m_Level + 1);
+                auto queries = make_queries(QUERIES, size, worldSize, rng);
+                size_t found = 0;
+
+                start = Clock::now();
 
-                return m_Children[i]->insert(item, area);
+                for (const auto& query : queries)
+                    grid.find(query, [&](auto) { found++; });
+
+                std::string name = "query " + std::to_string((int)size);
+                print_row("grid", count, name.c_str(), elapsed_ms(start), QUERIES, found);
             }
-        }
 
-        // It fits within the area of the current child
-        // but it doesn't fit within any area of the children
-        // so stop here
-        m_Items.push_back({ item, area });
+            start = Clock::now();
 
-        return { std::prev(m_Items.end()), &m_Items };
-    }
+            for (size_t i = 0; i < plants.size(); i += 10)
+                grid.remove(&plants[i].first);
 
-    void find(const def::rectf& area, std::list<T>& data)
-    {
-        for (const auto& item : m_Items)
-        {
-            if (overlaps(area, item.second))
-                data.push_back(item.first);
+            print_row("grid", count, "remove", elapsed_ms(start), removals);
         }
 
-        for (size_t i = 0; i < 4; i++)
+        // Linear scan over a flat array
         {
-            if (m_Children[i])
+            std::vector<Plant> flat;
+
+            auto start = Clock::now();
+
+            for (const auto& plant : plants)
+                flat.push_back(plant.first);
+
+            print_row("linear", count, "insert", elapsed_ms(start), count);
+            print_memory("linear", count, flat.capacity() * sizeof(Plant));
+
+            for (float size : QUERY_SIZES)
             {
-                if (def::contains(area, m_ChildrenAreas[i]))
-                    m_Children[i]->collect_items(data);
+                auto queries = make_queries(QUERIES, size, worldSize, rng);
+                size_t found = 0;
+
+                start = Clock::now();
+
+                for (const auto& query : queries)
+                {
+                    for (const auto& plant : flat)
+                    {
+                        if (overlaps(query, plant.area))
+                            found++;
+                    }
+                }
+
+                std::string name = "query " + std::to_string((int)size);
+                print_row("linear", count, name.c_str(), elapsed_ms(start), QUERIES, found);
+            }
+
+            // Order doesn't matter so swap with the last one
+            start = Clock::now();
 
-                else if (overlaps(m_ChildrenAreas[i], area))
-                    m_Children[i]->find(area, data);
+            for (size_t i = 0; i < removals; i++)
+            {
+                flat[i] = flat.back();
+                flat.pop_back();
             }
+
+            print_row("linear", count, "remove", elapsed_ms(start), removals);
         }
+
+        printf("\n");
     }
 
-    bool remove(const T& item)
+    template <bool Loose>
+    void loose_against_tight(const char* name, const Plants& plants, float worldSize, bool motion)
     {
-        auto it = std::find_if(m_Items.begin(), m_Items.end(),
-                               [&](const std::pair<T, def::rectf>& i) { return i.first == item; });
+        constexpr size_t FRAMES = 5;
+        constexpr size_t QUERIES = 200;
 
-        if (it != m_Items.end())
-        {
-            m_Items.erase(it);
-            return true;
-        }
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> position(0.0f, worldSize - 1280.0f);
+        std::uniform_real_distribution<float> step(-8.0f, 8.0f);
 
-        for (size_t i = 0; i < 4; i++)
+        QuadTreeContainer<Plant, Loose> tree({ { 0.0f, 0.0f }, { worldSize, worldSize } });
+
+        auto start = Clock::now();
+        tree.build(plants);
+        double buildTime = elapsed_ms(start);
+
+        std::vector<typename QuadTreeContainer<Plant, Loose>::Storage::iterator> handles;
+        tree.find({ { 0.0f, 0.0f }, { worldSize, worldSize } }, handles);
+
+        double moveTime = 0.0;
+        double queryTime = 0.0;
+        size_t found = 0;
+
+        for (size_t frame = 0; frame < FRAMES; frame++)
         {
-            if (m_Children[i])
+            if (motion)
+            {
+                start = Clock::now();
+
+                for (auto& handle : handles)
+                {
+                    def::rectf& area = handle->data.area;
+                    area.pos.x = std::clamp(area.pos.x + step(rng), 0.0f, worldSize - area.size.x);
+                    area.pos.y = std::clamp(area.pos.y + step(rng), 0.0f, worldSize - area.size.y);
+
+                    tree.relocate(handle, area);
+                }
+
+                moveTime += elapsed_ms(start);
+            }
+
+            start = Clock::now();
+
+            for (size_t i = 0; i < QUERIES; i++)
             {
-                if (m_Children[i]->remove(item))
-                    return true;
+                def::rectf viewport({ position(rng), position(rng) }, { 1280.0f, 960.0f });
+                tree.find(viewport, [&](auto) { found++; });
             }
+
+            queryTime += elapsed_ms(start);
         }
 
-        return false;
+        // The whole world on a 1024 pixels wide screen with 8 pixel tiles
+        size_t drawn = 0;
+        start = Clock::now();
+
+        tree.find_lod({ { 0.0f, 0.0f }, { worldSize, worldSize } }, worldSize / 128.0f,
+            [&](auto) { drawn++; }, [&](const def::rectf&, size_t, const uint32_t*) { drawn++; });
+
+        double lodTime = elapsed_ms(start);
+
+        printf("%-6s %-9s build %8.1f ms   move %8.1f ms/frame   query %6.3f ms   %zu found   lod %6.3f ms   %zu drawn\n",
+            name, motion ? "moving" : "static", buildTime, moveTime / FRAMES,
+            queryTime / (FRAMES * QUERIES), found / (FRAMES * QUERIES), lodTime, drawn);
+
+        print_stats(name, tree.stats());
     }
 
-    void collect_items(std::list<T>& items)
+    // Full and compact areas of the same plants, the compact queries also return some plants just outside
+    template <bool Compact>
+    void compact_against_full(const char* name, const Plants& plants, float worldSize)
     {
-        for (const auto& item : m_Items)
-            items.push_back(item.first);
+        constexpr size_t QUERIES = 1000;
 
-        for (auto& child : m_Children)
-        {
-            if (child)
-                child->collect_items(items);
-        }
+        std::mt19937 rng(1);
+        auto queries = make_queries(QUERIES, 512.0f, worldSize, rng);
+
+        std::vector<std::pair<uint32_t, def::rectf>> items(plants.size());
+
+        for (size_t i = 0; i < plants.size(); i++)
+            items[i] = { uint32_t(i), plants[i].second };
+
+        QuadTree<uint32_t, false, Compact> tree({ { 0.0f, 0.0f }, { worldSize, worldSize } });
+        tree.set_subdivision({ 16 });
+
+        auto start = Clock::now();
+        tree.build(items);
+        double buildTime = elapsed_ms(start);
+
+        size_t found = 0;
+        size_t outside = 0;
+
+        start = Clock::now();
+
+        for (const auto& query : queries)
+            tree.find(query, [&](uint32_t) { found++; });
+
+        double queryTime = elapsed_ms(start);
+
+        for (const auto& query : queries)
+            tree.find(query, [&](uint32_t i) { outside += !overlaps(query, items[i].second); });
+
+        size_t bytes = tree.memory_usage();
+
+        printf("%-7s build %8.1f ms   query 512 %7.3f us   %zu found   %zu outside   %zu bytes   %.1f bytes/item\n",
+            name, buildTime, queryTime * 1000.0 / QUERIES, found / QUERIES, outside, bytes, (double)bytes / plants.size());
     }
 
-    void collect_areas(std::list<def::rectf>& areas)
+    // The same plants inserted one by one and built with fewer splits
+    template <bool Loose>
+    void split_thresholds(const char* name, const Plants& plants, float worldSize)
     {
-        areas.push_back(m_Area);
+        constexpr size_t QUERIES = 1000;
 
-        for (size_t i = 0; i < 4; i++)
+        std::mt19937 rng(1);
+        auto queries = make_queries(QUERIES, 512.0f, worldSize, rng);
+
+        for (size_t threshold : { 0, 4, 16, 64 })
         {
-            if (m_Children[i])
-                m_Children[i]->collect_areas(areas);
+            QuadTreeContainer<Plant, Loose> tree({ { 0.0f, 0.0f }, { worldSize, worldSize } });
+            tree.set_subdivision({ threshold });
+
+            auto start = Clock::now();
+
+            for (const auto& [plant, area] : plants)
+                tree.insert(plant, area);
+
+            double insertTime = elapsed_ms(start);
+
+            start = Clock::now();
+            tree.build(plants);
+            double buildTime = elapsed_ms(start);
+
+            size_t found = 0;
+            start = Clock::now();
+
+            for (const auto& query : queries)
+                tree.find(query, [&](auto) { found++; });
+
+            double queryTime = elapsed_ms(start);
+            auto stats = tree.stats();
+
+            printf("%-6s split above %-3zu insert %8.1f ms   build %8.1f ms   query 512 %7.3f us   %zu found   %zu nodes   depth %zu max %.1f average\n",
+                name, threshold, insertTime, buildTime, queryTime * 1000.0 / QUERIES, found / QUERIES,
+                stats.nodes, stats.maxDepth, stats.averageDepth);
         }
     }
 
-private:
-    size_t m_Level;
+    // Viewport queries on the main thread while another thread moves every 10th plant each frame
+    void double_buffer(const Plants& plants, float worldSize)
+    {
+        constexpr size_t QUERIES = 2000;
 
-    def::rectf m_Area;
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> position(0.0f, worldSize - 1280.0f);
+        std::uniform_real_distribution<float> step(-8.0f, 8.0f);
 
-    // All 4 children of a current quad
-    std::array<std::shared_ptr<QuadTree<T>>, 4> m_Children;
+        QuadTreeDoubleBuffer<Plant> tree({ { 0.0f, 0.0f }, { worldSize, worldSize } });
+        std::vector<QuadTreeDoubleBuffer<Plant>::Handle> handles;
 
-    // Cached areas of each item from the m_Children array
-    std::array<def::rectf, 4> m_ChildrenAreas;
+        for (const auto& [plant, area] : plants)
+            handles.push_back(tree.insert(plant, area));
 
-    // Items in the current quad
-    Storage m_Items;
-};
+        tree.publish();
 
-template <class T>
-class QuadTreeContainer
-{
-public:
-    struct Item
-    {
-        T data;
-        typename QuadTree<typename std::list<Item>::iterator>::ItemLocation location;
-    };
+        std::vector<def::rectf> viewports(QUERIES);
 
-    using Storage = std::list<Item>;
+        for (auto& viewport : viewports)
+            viewport = def::rectf({ position(rng), position(rng) }, { 1280.0f, 960.0f });
 
-    QuadTreeContainer(const def::rectf& area = { {0.0f, 0.0f}, {128.0f, 128.0f} }, size_t level = 0)
-    {
-        create(area, level);
-    } 
+        auto query = [&](const char* name)
+            {
+                size_t found = 0;
+                auto start = Clock::now();
 
-    void create(const def::rectf& area = { {0.0f, 0.0f}, {128.0f, 128.0f} }, size_t level = 0)
-    {
-        m_Root.create(area, level);
-    }
+                for (const auto& viewport : viewports)
+                    tree.find(viewport, [&](const Plant&) { found++; });
 
-    void clear()
-    {
-        m_Root.clear();
-    }
+                printf("%10zu  %-12s %-16s %12.3f ms %12.3f us/op %10.1f found/op\n", plants.size(), "doublebuffer",
+                    name, elapsed_ms(start), elapsed_ms(start) * 1000.0 / QUERIES, (double)found / QUERIES);
+            };
 
-    size_t size() const
-    {
-        return m_Root.size();
-    }
+        query("query");
 
-    void insert(const T& item, const def::rectf& area)
-    {
-        m_Items.push_back({ item });
-        m_Items.back().location = m_Root.insert(std::prev(m_Items.end()), area);
-    }
+        std::atomic<bool> stop = false;
+        std::atomic<size_t> frames = 0;
+        double writeTime = 0.0;
 
-    void find(const def::rectf& area, std::list<typename Storage::iterator>& data)
-    {
-        m_Root.find(area, data);
-    }
+        std::thread writer([&]()
+            {
+                std::vector<def::rectf> areas;
 
-    void remove(typename Storage::iterator item)
-    {
-        item->location.container->erase(item->location.iterator);
-        m_Items.erase(item);
-    }
+                for (const auto& plant : plants)
+                    areas.push_back(plant.second);
 
-    void collect_items(Storage& items)
-    {
-        m_Root.collect_items(items);
-    }
+                while (!stop)
+                {
+                    auto start = Clock::now();
 
-    void collect_areas(std::list<def::rectf>& areas)
-    {
-        m_Root.collect_areas(areas);
-    }
+                    for (size_t i = frames % 10; i < handles.size(); i += 10)
+                    {
+                        def::rectf& area = areas[i];
+                        area.pos.x = std::clamp(area.pos.x + step(rng), 0.0f, worldSize - area.size.x);
+                        area.pos.y = std::clamp(area.pos.y + step(rng), 0.0f, worldSize - area.size.y);
 
-private:
-    Storage m_Items;
-    QuadTree<typename Storage::iterator> m_Root;
+                        tree.relocate(handles[i], area);
+                    }
 
-};
+                    tree.publish();
 
-class App : public def::GameEngine
-{
-public:
-    App()
-    {
-        GetWindow()->SetTitle("Quad trees");
-        UseOnlyTextures(true);
+                    writeTime += elapsed_ms(start);
+                    frames++;
+                }
+            });
+
+        // Let the writer get going
+        while (frames == 0)
+            std::this_thread::yield();
+
+        query("query + writer");
+
+        stop = true;
+        writer.join();
+
+        printf("%10zu  %-12s %-16s %12.3f ms %12zu frames\n", plants.size(), "doublebuffer", "move + publish", writeTime / frames, (size_t)frames);
     }
 
-    enum class PlantID
+    // Immediate changes mixed with the recorded ones of the same items, every case leaves
+    // the container as if the changes were made one by one in that order
+    bool check_deferred()
     {
-        LargeTree,
-        LargeBush,
-        SmallTree,
-        SmallBush
-    };
+        using Tree = QuadTreeContainer<int>;
 
-    struct Object
-    {
-        def::rectf area;
-        PlantID id;
-    };
+        const def::rectf world({ 0.0f, 0.0f }, { 1024.0f, 1024.0f });
+        const def::rectf start({ 100.0f, 100.0f }, { 8.0f, 8.0f });
+        const def::rectf moved({ 700.0f, 700.0f }, { 8.0f, 8.0f });
+        const def::rectf aside({ 400.0f, 400.0f }, { 8.0f, 8.0f });
 
-    QuadTreeContainer<Object> tree;
+        Tree tree(world);
+        std::vector<Tree::Storage::iterator> items;
 
-    def::AffineTransforms at;
+        for (int id = 0; id < 6; id++)
+        {
+            tree.insert(id, start);
 
-    float worldSize = 25000.0f;
-    float searchAreaSize = 100.0f;
+            std::vector<Tree::Storage::iterator> found;
+            tree.find(world, found);
 
-    def::Graphic plants;
+            for (auto item : found)
+            {
+                if (item->data == id)
+                    items.push_back(item);
+            }
+        }
 
-protected:
-    bool OnUserCreate() override
-    {
-        tree.create({ {0.0f, 0.0f}, {worldSize, worldSize} });
-        at.SetViewArea(GetWindow()->GetScreenSize());
+        bool ok = true;
 
-        auto rand_float = [](float min, float max)
+        auto expect = [&](bool condition, const char* name)
             {
-                return min + (float)rand() / (float)RAND_MAX * (max - min);
+                if (!condition)
+                {
+                    printf("deferred commands: %s FAILED\n", name);
+                    ok = false;
+                }
             };
 
-        for (size_t i = 0; i < 1000000; i++)
-        {
-            Object o;
+        auto count_at = [&](const def::rectf& area, int id)
+            {
+                size_t count = 0;
+                tree.find(area, [&](Tree::Storage::iterator item) { count += item->data == id; });
+                return count;
+            };
 
-            o.area.pos = { rand_float(0.0f, worldSize), rand_float(0.0f, worldSize) };
-            o.id = PlantID(rand() % 4);
+        // A recorded move of an item that is gone by the commit
+        tree.defer_relocate(items[0], moved);
+        tree.remove(items[0]);
 
-            o.area.size.x = 16.0f;
-            
-            if (o.id == PlantID::LargeTree || o.id == PlantID::LargeBush)
-                o.area.size.y = 32.0f;
-            else
-                o.area.size.x = 16.0f;
+        tree.defer_relocate(items[1], moved);
+        tree.defer_relocate(items[2], moved);
+        tree.erase_in(def::rectf({ 96.0f, 96.0f }, { 16.0f, 16.0f }));
 
-            tree.insert(o, o.area);
-        }
+        // The later immediate move wins over the recorded one, the recorded removal still happens
+        items.clear();
 
-        plants.Load("plants.png");
+        for (int id = 10; id < 13; id++)
+            items.push_back(tree.defer_insert(id, start));
 
-        return true;
+        items.push_back(tree.defer_insert(13, moved));
+
+        tree.commit();
+
+        tree.defer_relocate(items[0], moved);
+        tree.relocate(items[0], start);
+
+        tree.defer_remove(items[1]);
+        tree.relocate(items[1], moved);
+
+        // A recorded move after a recorded removal keeps the item
+        tree.defer_remove(items[3]);
+        tree.defer_relocate(items[3], aside);
+
+        // The items of defer_insert() are only changed through the deferred calls before the commit,
+        // each check gets its own item as the handle can't be used once the call could have freed it
+        expect(!tree.remove(tree.defer_insert(20, start)), "remove before the commit");
+        expect(!tree.relocate(tree.defer_insert(21, start), moved), "relocate before the commit");
+        expect(tree.erase_in(start) == 2, "erase_in skips the items waiting for the commit");
+
+        tree.commit();
+
+        expect(tree.size() == 3, "size");
+        expect(count_at(world, 0) + count_at(world, 1) + count_at(world, 2) == 0, "erased items stay erased");
+        expect(count_at(world, 10) + count_at(world, 11) + count_at(world, 12) == 0, "erase_in after the moves");
+        expect(count_at(aside, 13) == 1, "move after a removal");
+        expect(count_at(start, 20) == 1 && count_at(start, 21) == 1, "inserts after erase_in");
+
+        printf("deferred commands: %s\n", ok ? "ok" : "FAILED");
+        return ok;
     }
 
-    bool OnUserUpdate(float) override
+    // The compact areas are rounded outwards, erase_in() must still only remove the items that overlap the area
+    bool check_compact_erase()
     {
-        auto i = GetInput();
+        using Tree = QuadTreeContainer<Plant, false, true>;
 
-        if (i->GetButtonState(def::Button::WHEEL).pressed)
-            at.StartPan(GetInput()->GetMousePosition());
+        const def::rectf world({ 0.0f, 0.0f }, { 1024.0f, 1024.0f });
+        const def::rectf blast({ 100.0f, 100.0f }, { 100.0f, 100.0f });
 
-        if (i->GetButtonState(def::Button::WHEEL).held)
-            at.UpdatePan(GetInput()->GetMousePosition());
+        Tree tree(world);
 
-        if (i->GetScrollDelta() > 0)
+        // Two plants just outside the edges of the blast, closer to them than the rounding of their areas,
+        // and two just inside
+        std::vector<Plant> plants = {
+            { def::rectf({ 200.001f, 150.0f }, { 600.0f, 8.0f }), 0 },
+            { def::rectf({ 150.0f, 90.0f }, { 8.0f, 9.999f }), 1 },
+            { def::rectf({ 199.99f, 150.0f }, { 600.0f, 8.0f }), 2 },
+            { def::rectf({ 150.0f, 90.0f }, { 8.0f, 10.01f }), 3 }
+        };
+
+        for (const auto& plant : plants)
+            tree.insert(plant, plant.area);
+
+        size_t removed = tree.erase_in(blast, [&](const Plant& plant) { return overlaps(blast, plant.area); });
+
+        std::vector<int> left;
+        tree.find(world, [&](Tree::Storage::iterator item) { left.push_back(item->data.id); });
+        std::sort(left.begin(), left.end());
+
+        bool ok = removed == 2 && left == std::vector<int>{ 0, 1 };
+
+        printf("compact erase_in: %s\n", ok ? "ok" : "FAILED");
+        return ok;
+    }
+
+    // Item count given on the command line, false if it isn't a positive number
+    bool parse_count(const char* text, size_t& count)
+    {
+        if (!std::isdigit((unsigned char)text[0]))
+            return false;
+
+        char* end = nullptr;
+        errno = 0;
+
+        unsigned long long value = std::strtoull(text, &end, 10);
+
+        if (errno == ERANGE || *end != '\0' || value == 0)
+            return false;
+
+        count = size_t(value);
+        return true;
+    }
+
+    int run(int argc, char** argv)
+    {
+        std::vector<size_t> counts;
+        bool loose = false;
+        bool split = false;
+        bool concurrent = false;
+        bool compact = false;
+        bool check = false;
+
+        for (int i = 1; i < argc; i++)
         {
-            if (i->GetKeyState(def::Key::LEFT_CONTROL).held)
-                searchAreaSize *= 0.9f;
+            if (strcmp(argv[i], "loose") == 0)
+                loose = true;
+            else if (strcmp(argv[i], "split") == 0)
+                split = true;
+            else if (strcmp(argv[i], "concurrent") == 0)
+                concurrent = true;
+            else if (strcmp(argv[i], "compact") == 0)
+                compact = true;
+            else if (strcmp(argv[i], "check") == 0)
+                check = true;
             else
-                at.Zoom(1.1f, i->GetMousePosition());
+            {
+                size_t count;
+
+                if (!parse_count(argv[i], count))
+                {
+                    fprintf(stderr, "unknown argument: %s\n", argv[i]);
+                    fprintf(stderr, "usage: %s [item count ...] [loose] [split] [concurrent] [compact] [check]\n", argv[0]);
+                    return 1;
+                }
+
+                counts.push_back(count);
+            }
         }
 
-        if (i->GetScrollDelta() < 0)
+        if (check)
         {
-            if (i->GetKeyState(def::Key::LEFT_CONTROL).held)
-                searchAreaSize *= 1.1f;
-            else
-                at.Zoom(0.9f, i->GetMousePosition());
+            bool deferred = check_deferred();
+            bool compactErase = check_compact_erase();
+
+            return deferred && compactErase ? 0 : 1;
         }
 
-        def::Vector2f mouse = at.ScreenToWorld(i->GetMousePosition());
-        def::rectf selectedArea({ mouse.x - searchAreaSize * 0.5f, mouse.y - searchAreaSize * 0.5f }, { searchAreaSize, searchAreaSize });
+        if (counts.empty() && !loose && !split && !concurrent && !compact)
+            counts = { 10000, 100000, 1000000, 10000000 };
 
-        if (i->GetButtonState(def::Button::LEFT).held)
+        for (size_t count : counts)
+            compare(count);
+
+        if (loose)
         {
-            std::list<std::list<QuadTreeContainer<Object>::Item>::iterator> selected;
-            tree.find(selectedArea, selected);
+            const float worldSize = world_size(1000000);
 
-            for (auto& item : selected)
-                tree.remove(item);
-        }
+            std::mt19937 rng(0);
+            Plants plants = make_plants(1000000, worldSize, rng);
 
-        def::Vector2f origin = at.GetOrigin();
-        def::Vector2f size = at.GetEnd() - origin;
+            for (bool motion : { false, true })
+            {
+                loose_against_tight<false>("tight", plants, worldSize, motion);
+                loose_against_tight<true>("loose", plants, worldSize, motion);
+            }
+        }
 
-        def::rectf searchArea = { { origin.x, origin.y }, { size.x, size.y } };
+        if (split)
+        {
+            const float worldSize = world_size(1000000);
 
-        std::list<std::list<QuadTreeContainer<Object>::Item>::iterator> objects;
-        tree.find(searchArea, objects);
+            std::mt19937 rng(0);
+            Plants plants = make_plants(1000000, worldSize, rng);
 
-        ClearTexture(def::GREEN);
+            split_thresholds<false>("tight", plants, worldSize);
+            split_thresholds<true>("loose", plants, worldSize);
+        }
 
-        for (const auto& obj : objects)
+        if (concurrent)
         {
-            def::Vector2f pos = { obj->data.area.pos.x, obj->data.area.pos.y };
+            const float worldSize = world_size(100000);
 
-            switch (obj->data.id)
-            {
-            case PlantID::LargeTree: at.DrawPartialTexture(pos, plants.texture, { 0.0f, 0.0f }, { 16.0f, 32.0f }); break;
-            case PlantID::LargeBush: at.DrawPartialTexture(pos, plants.texture, { 16.0f, 0.0f }, { 16.0f, 32.0f }); break;
-            case PlantID::SmallTree: at.DrawPartialTexture(pos, plants.texture, { 32.0f, 7.0f }, { 16.0f, 25.0f }); break;
-            case PlantID::SmallBush: at.DrawPartialTexture(pos, plants.texture, { 48.0f, 16.0f }, { 16.0f, 16.0f }); break;
-            }
+            std::mt19937 rng(0);
+            double_buffer(make_plants(100000, worldSize, rng), worldSize);
         }
 
-        DrawTextureString({ 0, 0 }, std::to_string(objects.size()));
-        at.FillTextureRectangle(
-            { selectedArea.pos.x, selectedArea.pos.y },
-            { selectedArea.size.x, selectedArea.size.y },
-            def::Pixel(255, 255, 255, 100));
+        if (compact)
+        {
+            const float worldSize = world_size(1000000);
 
-        return true;
+            std::mt19937 rng(0);
+            Plants plants = make_plants(1000000, worldSize, rng);
+
+            compact_against_full<false>("full", plants, worldSize);
+            compact_against_full<true>("compact", plants, worldSize);
+        }
+
+        return 0;
     }
-};
+}
+
+int main(int argc, char** argv)
+{
+    return Benchmark::run(argc, argv);
+}
+
+#else
 
 int main()
 {
@@ -389,4 +5405,6 @@ int main()
         app.Run();
 
     return 0;
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file